@@ -0,0 +1,317 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Protocol core benchmark
+ * Times the per-frame hot paths of the core (checksums, frame parser,
+ * region decoders, PIN encoding and lookup, zone publish loop) and counts
+ * their heap allocations. Each one runs on a frame as polled on the
+ * device. The implementations they replaced (ostringstream alarm info
+ * parsing, string PIN encoding, linear PINs scan and per-bit publish
+ * loop) run next to them, marked "(old)", for a before/after comparison.
+ * Fails if any of the current paths allocates. Usage:
+ *   kyo-bench [-n iterations]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+#include "kyo-protocol.h"
+
+using namespace kyo_protocol;
+
+static size_t allocations = 0;
+static volatile uint32_t sink = 0;
+
+void *operator new(size_t size) {
+    void *ptr = malloc(size);
+
+    allocations++;
+
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return (ptr);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+static int failures = 0;
+
+// Run function iterations times, print time and allocations per frame, old paths are allowed to allocate
+template<typename F>
+static void measure(const char *name, long iterations, F function, bool old = false) {
+    size_t start = allocations;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    for (long i = 0; i < iterations; i++) {
+        function(static_cast<uint32_t>(i));
+    }
+
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    double allocs = static_cast<double>(allocations - start) / iterations;
+
+    printf("%-22s %8.1f ns/frame %6.2f allocs/frame\n", name, elapsed / iterations, allocs);
+
+    if ((allocations != start) && (old == false)) {
+        failures++;
+    }
+}
+
+/*
+ * Replaced implementations
+ * Kept as they were in the component before the core was split out, to
+ * compare against the current paths.
+ */
+namespace old {
+
+// Entity publish stand-in, not inlined so each call costs as much as in the loop
+__attribute__((noinline)) static void publish(int index, bool state) {
+    sink += index + state;
+}
+
+static void rtrim(std::string &str) {
+    str.erase(std::find_if(str.rbegin(), str.rend(), [](unsigned char ch) {
+        return !std::isspace(ch);
+    }).base(), str.end());
+}
+
+// Alarm info reply through a string stream and sub-strings
+static AlarmModel decodeAlarmInfo(const uint8_t *reply, size_t size) {
+    std::ostringstream convert;
+
+    for (size_t i = 0; i < size; i++) {
+        convert << reply[i];
+    }
+
+    std::string model = convert.str().substr(0, 7);
+    rtrim(model);
+
+    std::string firmware = convert.str().substr(8, 11);
+    rtrim(firmware);
+
+    sink += firmware.size();
+
+    if (model == KYO_MODEL_4) return (AlarmModel::KYO_4);
+    if (model == KYO_MODEL_8) return (AlarmModel::KYO_8);
+    if (model == KYO_MODEL_8G) return (AlarmModel::KYO_8G);
+    if (model == KYO_MODEL_32) return (AlarmModel::KYO_32);
+    if (model == KYO_MODEL_32G) return (AlarmModel::KYO_32G);
+    if (model == KYO_MODEL_8W) return (AlarmModel::KYO_8W);
+    if (model == KYO_MODEL_8GW) return (AlarmModel::KYO_8GW);
+    return (AlarmModel::UNKNOWN);
+}
+
+// PIN taken by value, padded with 'f' and encoded digit by digit
+static uint32_t encodePin(std::string pin) {
+    uint32_t pinCode = 0;
+
+    if ((pin.length() > 3) && (pin.length() < 7) && (std::all_of(pin.begin(), pin.end(), ::isdigit))) {
+        pin.insert(pin.end(), 6 - pin.length(), 'f');
+
+        for (char c: pin) {
+            pinCode <<= 4;
+            pinCode |= (c == 'f') ? 0xf : c - 0x30;
+        }
+    }
+
+    return (pinCode);
+}
+
+// Linear scan of the raw PINs list
+static bool containsPin(const uint8_t *pinsList, uint32_t pinCode) {
+    for (size_t i = 0; i < KYO_STORED_PINS * 3; i += 3) {
+        uint32_t pinRef = 0;
+
+        pinRef |= (pinsList[i] << 16) & 0x00FF0000;
+        pinRef |= (pinsList[i + 1] << 8) & 0x0000FF00;
+        pinRef |=  pinsList[i + 2] & 0x000000FF;
+
+        if (pinCode == pinRef) {
+            return (true);
+        }
+    }
+
+    return (false);
+}
+
+}
+
+static uint8_t toBcd(uint32_t value) {
+    return (static_cast<uint8_t>(((value / 10) << 4) | (value % 10)));
+}
+
+int main(int argc, char *argv[]) {
+    const Region &region = REGION_MAP[REGION_STATUS];
+    const Command command = {FRAME_READ, region.addr, static_cast<uint8_t>(region.size - 1), region.timeout};
+    long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            iterations = atol(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return (1);
+        }
+    }
+
+    // Exchange as received: request echo, then status data and checksum
+    Frame request;
+    uint8_t exchange[HEADER_SIZE + MAX_REPLY_SIZE];
+    uint8_t *reply = &exchange[HEADER_SIZE];
+    size_t replySize = getReplySize(command);
+
+    encode(command, request);
+    memcpy(exchange, request.data, request.size);
+
+    for (size_t i = 0; i < replySize - 1; i++) {
+        reply[i] = static_cast<uint8_t>(i * 37);
+    }
+
+    reply[replySize - 1] = getChecksum(reply, replySize - 1);
+
+    // Full PINs region, PINs 123400 - 123423
+    uint8_t pinsList[REGION_MAP[REGION_PINS].size];
+    PinTable<KYO_STORED_PINS> pins;
+
+    for (size_t i = 0; i < KYO_STORED_PINS; i++) {
+        pinsList[3 * i] = 0x12;
+        pinsList[3 * i + 1] = 0x34;
+        pinsList[3 * i + 2] = toBcd(i);
+    }
+
+    pins.load(pinsList, sizeof(pinsList));
+
+    measure("getChecksum", iterations, [&](uint32_t i) {
+        reply[0] = static_cast<uint8_t>(i);
+        sink += getChecksum(reply, replySize - 1);
+    });
+
+    measure("verifyChecksum", iterations, [&](uint32_t i) {
+        reply[0] = static_cast<uint8_t>(i);
+        sink += verifyChecksum(reply, replySize);
+    });
+
+    reply[0] = 0;
+    reply[replySize - 1] = getChecksum(reply, replySize - 1);
+
+    measure("FrameParser::push", iterations, [&](uint32_t) {
+        FrameParser parser;
+
+        parser.begin(request.data, request.size, replySize);
+
+        for (size_t i = 0; i < request.size + replySize; i++) {
+            parser.push(exchange[i]);
+        }
+
+        sink += parser.isValid();
+    });
+
+    measure("decodeStatus", iterations, [&](uint32_t i) {
+        Status status;
+
+        reply[ST_BYPASSED] = static_cast<uint8_t>(i);
+        decodeStatus(reply, region.size, status);
+        sink += status.bypassed;
+    });
+
+    measure("decodeRealTimeStatus", iterations, [&](uint32_t i) {
+        RealTimeStatus status;
+
+        reply[RT_ZONES] = static_cast<uint8_t>(i);
+        decodeRealTimeStatus(reply, REGION_MAP[REGION_REAL_TIME_STATUS].size, status);
+        sink += status.zones;
+    });
+
+    measure("PinTable::contains", iterations, [&](uint32_t i) {
+        sink += pins.contains(0x123400 | toBcd(i % (KYO_STORED_PINS + 8)));
+    });
+
+    measure("PINs scan (old)", iterations, [&](uint32_t i) {
+        sink += old::containsPin(pinsList, 0x123400 | toBcd(i % (KYO_STORED_PINS + 8)));
+    }, true);
+
+    // PINs as received from the API, 4 - 6 digits
+    const std::string codes[] = {"1234", "12345", "123456", "123423"};
+
+    measure("encodePin", iterations, [&](uint32_t i) {
+        uint32_t pinCode;
+
+        sink += encodePin(codes[i % 4], pinCode) ? pinCode : 0;
+    });
+
+    measure("encodePin (old)", iterations, [&](uint32_t i) {
+        sink += old::encodePin(codes[i % 4]);
+    }, true);
+
+    // Alarm info region of a KYO32, model and firmware space padded
+    uint8_t alarmInfo[REGION_MAP[REGION_ALARM_INFO].size];
+
+    memcpy(alarmInfo, "KYO32   5.02", sizeof(alarmInfo));
+
+    measure("decodeAlarmInfo", iterations, [&](uint32_t i) {
+        AlarmInfo info;
+
+        alarmInfo[11] = static_cast<uint8_t>('0' + i % 10);
+        decodeAlarmInfo(alarmInfo, sizeof(alarmInfo), info);
+        sink += static_cast<uint32_t>(info.alarmModel);
+    });
+
+    measure("decodeAlarmInfo (old)", iterations, [&](uint32_t i) {
+        alarmInfo[11] = static_cast<uint8_t>('0' + i % 10);
+        sink += static_cast<uint32_t>(old::decodeAlarmInfo(alarmInfo, sizeof(alarmInfo)));
+    }, true);
+
+    // Zones of a real-time read, the 4 lowest change from frame to frame
+    MaskTracker zones;
+
+    measure("publish zones", iterations, [&](uint32_t i) {
+        uint32_t changed = zones.update(i & 0x0f);
+
+        while (changed != 0) {
+            int zone = popBit(changed);
+
+            old::publish(zone, (zones.getValue() >> zone) & 0x01);
+        }
+    });
+
+    measure("publish zones (old)", iterations, [&](uint32_t i) {
+        uint32_t info = i & 0x0f;
+
+        for (int zone = 0; zone < KYO_MAX_ZONES; zone++) {
+            old::publish(zone, (info >> zone) & 0x01);
+        }
+    }, true);
+
+    return (failures);
+}
@@ -0,0 +1,105 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Multi-panel gateway
+ * Polls the alarms on the given serial devices (or kyo-simulator ptys) and
+ * prints their state changes and link events until interrupted, then the
+ * statistics of each panel. Usage:
+ *   kyo-gateway [-t threads] [-r real_time_ms] [-s status_ms] device...
+ */
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "kyo-gateway.h"
+
+static volatile sig_atomic_t stopped = 0;
+
+static void onSignal(int) {
+    stopped = 1;
+}
+
+int main(int argc, char *argv[]) {
+    kyo_host::GatewayConfig config;
+    int opt;
+
+    config.log = stdout;
+
+    while ((opt = getopt(argc, argv, "t:r:s:")) != -1) {
+        switch (opt) {
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+
+            case 'r':
+                config.realTimeInterval = atoi(optarg);
+                break;
+
+            case 's':
+                config.statusInterval = atoi(optarg);
+                break;
+
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-t threads] [-r real_time_ms] [-s status_ms] device...\n", argv[0]);
+        return (1);
+    }
+
+    kyo_host::Gateway gateway(config);
+
+    for (int i = optind; i < argc; i++) {
+        if (gateway.add(argv[i]) == false) {
+            perror(argv[i]);
+            return (1);
+        }
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    if (gateway.start() == false) {
+        perror("Can't start workers");
+        return (1);
+    }
+
+    while (stopped == 0) {
+        pause();
+    }
+
+    gateway.stop();
+
+    for (size_t i = 0; i < gateway.getPanelCount(); i++) {
+        kyo_host::PanelState state = gateway.getPanel(i).getState();
+
+        fprintf(stderr, "%s: %s, %u reads, %u failures, %u rediscoveries, latency %.1f ms average, %u ms max\n",
+                gateway.getPanel(i).getPortName().c_str(), kyo_protocol::HealthMonitor::getName(state.health),
+                static_cast<unsigned>(state.reads), static_cast<unsigned>(state.failures), static_cast<unsigned>(state.rediscoveries),
+                (state.completed > 0) ? static_cast<double>(state.latencySum) / state.completed : 0.0, static_cast<unsigned>(state.latencyMax));
+    }
+
+    return (0);
+}
@@ -0,0 +1,501 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Multi-panel gateway
+ * Drives many alarms, one serial port and one kyo_protocol::Link each,
+ * from a small pool of worker threads. Panels are split among the workers,
+ * each worker waits on its own epoll set for received bytes or for the
+ * next link deadline or poll, then steps the ready panels. A panel uses the
+ * core classes of the ESPHome component (request queue, poll scheduler,
+ * memory mirror, decoders and link health) with its own read-only polling
+ * of discovery, real-time status and status, and rediscovery after the
+ * link is restored. Linux only.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/epoll.h>
+
+#include "kyo-protocol.h"
+#include "kyo-tty.h"
+
+namespace kyo_host {
+
+struct GatewayConfig {
+    uint32_t discoveryInterval = 1000;
+    uint32_t realTimeInterval = 250;
+    uint32_t statusInterval = 1000;
+    uint32_t downFailures = 3;
+    uint32_t probeMin = 100;
+    uint32_t probeMax = 2000;
+    size_t threads = 1;
+    FILE *log = nullptr;        // Changes and link events, nullptr for none
+};
+
+// Panel state and statistics, copied out of the worker
+struct PanelState {
+    kyo_protocol::AlarmModel model;
+    uint8_t partsList;
+    kyo_protocol::RealTimeStatus realTime;
+    kyo_protocol::Status status;
+    kyo_protocol::LinkHealth health;
+    uint32_t reads;             // Poll tasks completed
+    uint32_t failures;          // Failed requests
+    uint32_t rediscoveries;     // Link restored after being down
+    uint32_t latencySum;        // Latency of completed requests (ms)
+    uint32_t latencyMax;
+    uint32_t completed;
+};
+
+class GatewayPanel {
+    public:
+        GatewayPanel(const std::string &path, const GatewayConfig &config, std::mutex &logMutex) :
+            portName(path), config(config), logMutex(logMutex), health(config.downFailures, config.probeMin, config.probeMax) {
+            scheduler.setInterval(POLL_DISCOVERY, config.discoveryInterval);
+            scheduler.setInterval(POLL_REAL_TIME_STATUS, config.realTimeInterval);
+            scheduler.setInterval(POLL_STATUS, config.statusInterval);
+
+            planReads(POLL_DISCOVERY, kyo_protocol::getRegionMask(kyo_protocol::REGION_ALARM_INFO) |
+                      kyo_protocol::getRegionMask(kyo_protocol::REGION_PARTITIONS));
+            planReads(POLL_REAL_TIME_STATUS, kyo_protocol::getRegionMask(kyo_protocol::REGION_REAL_TIME_STATUS));
+            planReads(POLL_STATUS, kyo_protocol::getRegionMask(kyo_protocol::REGION_STATUS));
+        }
+
+        GatewayPanel(const GatewayPanel &) = delete;
+        GatewayPanel &operator=(const GatewayPanel &) = delete;
+
+        bool open() {
+            if (port.open(portName.c_str()) == false) {
+                return (false);
+            }
+
+            scheduler.reset(getMillis());
+            return (true);
+        }
+
+        // Run the link: complete the current request, then schedule and start the next one
+        void step(uint32_t now) {
+            if (link.isIdle() == false) {
+                TtyLink::Event event = link.process(now);
+
+                if (event == TtyLink::Event::NONE) {
+                    return;
+                }
+
+                complete((event == TtyLink::Event::COMPLETE) && link.getParser().isValid(), now);
+            } else {
+                // Nothing is expected, drop stray bytes so the descriptor is not ready again
+                while (port.available() > 0) {
+                    port.read();
+                }
+            }
+
+            schedule(now);
+
+            if (queue.pop(current, now) == true) {
+                link.start(current.frame, *current.command, now);
+            }
+        }
+
+        // Time until step() has something to do (ms)
+        uint32_t getWait(uint32_t now) const {
+            uint32_t wait = UINT32_MAX;
+
+            if (link.isIdle() == false) {
+                int32_t left = static_cast<int32_t>(link.getDeadline() - now);
+
+                return ((left > 0) ? left : 0);
+            }
+
+            if ((queue.isEmpty() == false) || health.isProbeDue(now)) {
+                return (0);
+            }
+
+            if (health.isDown() == true) {
+                return (config.probeMin);
+            }
+
+            for (int i = 0; i < POLL_TASKS; i++) {
+                if (isPollEnabled(i) == true) {
+                    int32_t lateness = scheduler.getLateness(i, now, scheduler.getInterval(i));
+
+                    wait = std::min(wait, static_cast<uint32_t>((lateness < 0) ? -lateness : 0));
+                }
+            }
+
+            return (wait);
+        }
+
+        int getFd() const {
+            return (port.getFd());
+        }
+
+        const std::string &getPortName() const {
+            return (portName);
+        }
+
+        PanelState getState() const {
+            std::lock_guard<std::mutex> lock(stateMutex);
+
+            return (state);
+        }
+
+    private:
+        typedef kyo_protocol::Link<TtyTransport> TtyLink;
+
+        enum PollTaskId {POLL_DISCOVERY, POLL_REAL_TIME_STATUS, POLL_STATUS, POLL_TASKS};
+
+        static const size_t PLAN_FRAMES = 4;
+
+        // Request of a poll task frame, or a probe (task is POLL_TASKS)
+        struct Request {
+            kyo_protocol::Frame frame;
+            const kyo_protocol::Command *command;
+            kyo_protocol::Priority priority;
+            uint32_t queued;
+            int task;
+            size_t index;
+        };
+
+        std::string portName;
+        const GatewayConfig &config;
+        std::mutex &logMutex;
+        TtyTransport port;
+        TtyLink link{port};
+        kyo_protocol::RequestQueue<Request, 8> queue;
+        kyo_protocol::PollScheduler<POLL_TASKS> scheduler;
+        kyo_protocol::HealthMonitor health;
+        kyo_protocol::PanelMemory memory;
+        kyo_protocol::Command frames[POLL_TASKS][PLAN_FRAMES];
+        size_t frameCount[POLL_TASKS];
+        Request current;
+        kyo_protocol::MaskTracker zones;
+        kyo_protocol::MaskTracker tampers;
+        kyo_protocol::MaskTracker bypassed;
+        kyo_protocol::MaskTracker disarmed;
+        mutable std::mutex stateMutex;
+        PanelState state = {};
+
+        void planReads(int task, uint32_t regions) {
+            frameCount[task] = kyo_protocol::planReads(regions, frames[task], PLAN_FRAMES);
+        }
+
+        bool isDiscovered() const {
+            return ((state.model != kyo_protocol::AlarmModel::UNKNOWN) && (state.partsList != 0));
+        }
+
+        bool isPollEnabled(int task) const {
+            return ((task == POLL_DISCOVERY) ? !isDiscovered() : isDiscovered());
+        }
+
+        void send(int task, size_t index, const kyo_protocol::Command &command, kyo_protocol::Priority priority, uint32_t now) {
+            Request request;
+
+            kyo_protocol::encode(command, request.frame);
+            request.command = &command;
+            request.priority = priority;
+            request.task = task;
+            request.index = index;
+            queue.push(request, now);
+        }
+
+        void schedule(uint32_t now) {
+            uint32_t intervals[POLL_TASKS];
+            uint32_t enabled = 0;
+            int next;
+
+            if ((link.isIdle() == false) || (queue.isEmpty() == false)) {
+                return;
+            }
+
+            // Only probe the alarm while the link is down
+            if (health.isDown() == true) {
+                if (health.isProbeDue(now) == true) {
+                    send(POLL_TASKS, 0, kyo_protocol::CMD_PROBE, kyo_protocol::Priority::ROUTINE, now);
+                }
+                return;
+            }
+
+            for (int i = 0; i < POLL_TASKS; i++) {
+                intervals[i] = scheduler.getInterval(i);
+                enabled |= isPollEnabled(i) ? (1 << i) : 0;
+            }
+
+            if ((next = scheduler.select(now, enabled, 0, intervals)) < 0) {
+                return;
+            }
+
+            scheduler.run(next, now);
+            send(next, 0, frames[next][0], kyo_protocol::Priority::ROUTINE, now);
+        }
+
+        void complete(bool success, uint32_t now) {
+            kyo_protocol::HealthMonitor::Event event = health.update(success, now);
+            std::lock_guard<std::mutex> lock(stateMutex);
+
+            if (success == true) {
+                state.latencySum += now - link.getStart();
+                state.latencyMax = std::max(state.latencyMax, now - link.getStart());
+                state.completed++;
+            } else {
+                state.failures++;
+            }
+
+            state.health = health.getHealth();
+
+            if (event == kyo_protocol::HealthMonitor::Event::DOWN) {
+                queue.clear();
+                print("link down");
+                return;
+            }
+
+            if (event == kyo_protocol::HealthMonitor::Event::RESTORED) {
+                state.rediscoveries++;
+                print("link restored");
+                rediscover(now);
+                return;
+            }
+
+            if ((success == false) || (current.task == POLL_TASKS)) {
+                return;
+            }
+
+            // Store data, without checksum, then read the next frame of the task or decode it
+            memory.store(current.command->addr, link.getParser().getReply(), link.getParser().getReplySize() - 1);
+
+            if (current.index + 1 < frameCount[current.task]) {
+                send(current.task, current.index + 1, frames[current.task][current.index + 1], kyo_protocol::Priority::FOLLOW_UP, now);
+                return;
+            }
+
+            state.reads++;
+            decode();
+        }
+
+        // Forget everything known about the alarm, discovery and all reads start over
+        void rediscover(uint32_t now) {
+            for (int id = 0; id < kyo_protocol::REGIONS; id++) {
+                memory.invalidate(static_cast<kyo_protocol::RegionId>(id));
+            }
+
+            zones.invalidate();
+            tampers.invalidate();
+            bypassed.invalidate();
+            disarmed.invalidate();
+            state.model = kyo_protocol::AlarmModel::UNKNOWN;
+            state.partsList = 0;
+            scheduler.reset(now);
+        }
+
+        // Decode the regions changed by the last read, called with the state locked
+        void decode() {
+            kyo_protocol::AlarmInfo info;
+
+            if (memory.isDirty(kyo_protocol::REGION_ALARM_INFO) &&
+                kyo_protocol::decodeAlarmInfo(memory.getData(kyo_protocol::REGION_ALARM_INFO), memory.getSize(kyo_protocol::REGION_ALARM_INFO), info)) {
+                state.model = info.alarmModel;
+                print("model %s, firmware %s", info.model, info.firmware);
+                memory.clearDirty(kyo_protocol::REGION_ALARM_INFO);
+            }
+
+            if (memory.isDirty(kyo_protocol::REGION_PARTITIONS) &&
+                kyo_protocol::decodePartitionsList(memory.getData(kyo_protocol::REGION_PARTITIONS), memory.getSize(kyo_protocol::REGION_PARTITIONS), state.partsList)) {
+                print("partitions %02x", state.partsList);
+                memory.clearDirty(kyo_protocol::REGION_PARTITIONS);
+            }
+
+            if (memory.isDirty(kyo_protocol::REGION_REAL_TIME_STATUS) &&
+                kyo_protocol::decodeRealTimeStatus(memory.getData(kyo_protocol::REGION_REAL_TIME_STATUS),
+                                                   memory.getSize(kyo_protocol::REGION_REAL_TIME_STATUS), state.realTime)) {
+                if (zones.update(state.realTime.zones) != 0) {
+                    print("zones %08x", static_cast<unsigned>(state.realTime.zones));
+                }
+
+                if (tampers.update(state.realTime.tampers) != 0) {
+                    print("tampers %08x", static_cast<unsigned>(state.realTime.tampers));
+                }
+
+                memory.clearDirty(kyo_protocol::REGION_REAL_TIME_STATUS);
+            }
+
+            if (memory.isDirty(kyo_protocol::REGION_STATUS) &&
+                kyo_protocol::decodeStatus(memory.getData(kyo_protocol::REGION_STATUS), memory.getSize(kyo_protocol::REGION_STATUS), state.status)) {
+                if (disarmed.update(state.status.disarmed) != 0) {
+                    print("armed away %02x, stay %02x, disarmed %02x", state.status.armedAway, state.status.armedStay, state.status.disarmed);
+                }
+
+                if (bypassed.update(state.status.bypassed) != 0) {
+                    print("bypassed %08x", static_cast<unsigned>(state.status.bypassed));
+                }
+
+                memory.clearDirty(kyo_protocol::REGION_STATUS);
+            }
+        }
+
+        template<typename... Args>
+        void print(const char *format, Args... args) {
+            if (config.log == nullptr) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(logMutex);
+
+            fprintf(config.log, "%s: ", portName.c_str());
+            fprintf(config.log, format, args...);
+            fputc('\n', config.log);
+        }
+};
+
+class Gateway {
+    public:
+        // Longest epoll wait, bounds the delay of a probe or poll enabled meanwhile
+        static const int MAX_WAIT_MS = 10;
+
+        explicit Gateway(const GatewayConfig &config = GatewayConfig()) : config(config) {}
+
+        ~Gateway() {
+            stop();
+        }
+
+        Gateway(const Gateway &) = delete;
+        Gateway &operator=(const Gateway &) = delete;
+
+        // Open a panel port, before start()
+        bool add(const std::string &path) {
+            std::unique_ptr<GatewayPanel> panel(new GatewayPanel(path, config, logMutex));
+
+            if (panel->open() == false) {
+                return (false);
+            }
+
+            panels.push_back(std::move(panel));
+            return (true);
+        }
+
+        // Split the panels among the worker threads and start them
+        bool start() {
+            size_t threads = std::max(static_cast<size_t>(1), std::min(config.threads, panels.size()));
+
+            running = true;
+
+            for (size_t i = 0; i < threads; i++) {
+                int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+                if (epfd < 0) {
+                    stop();
+                    return (false);
+                }
+
+                for (size_t p = i; p < panels.size(); p += threads) {
+                    struct epoll_event event = {};
+
+                    event.events = EPOLLIN;
+                    event.data.ptr = panels[p].get();
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, panels[p]->getFd(), &event);
+                }
+
+                workers.push_back(std::thread(&Gateway::run, this, epfd, i, threads));
+            }
+
+            return (true);
+        }
+
+        void stop() {
+            running = false;
+
+            for (std::thread &worker: workers) {
+                worker.join();
+            }
+
+            workers.clear();
+        }
+
+        size_t getPanelCount() const {
+            return (panels.size());
+        }
+
+        const GatewayPanel &getPanel(size_t index) const {
+            return (*panels[index]);
+        }
+
+        // Worker wake-ups and panels stepped since start
+        uint64_t getWakeups() const {
+            return (wakeups);
+        }
+
+        uint64_t getSteps() const {
+            return (steps);
+        }
+
+    private:
+        GatewayConfig config;
+        std::mutex logMutex;
+        std::vector<std::unique_ptr<GatewayPanel>> panels;
+        std::vector<std::thread> workers;
+        std::atomic<bool> running{false};
+        std::atomic<uint64_t> wakeups{0};
+        std::atomic<uint64_t> steps{0};
+
+        void run(int epfd, size_t shard, size_t threads) {
+            struct epoll_event events[64];
+
+            while (running == true) {
+                uint32_t now = getMillis();
+                uint32_t wait = MAX_WAIT_MS;
+                uint64_t stepped = 0;
+
+                for (size_t p = shard; p < panels.size(); p += threads) {
+                    wait = std::min(wait, panels[p]->getWait(now));
+                }
+
+                int count = epoll_wait(epfd, events, 64, static_cast<int>(wait));
+
+                now = getMillis();
+
+                // Panels with received bytes, then panels with a deadline or poll due
+                for (int i = 0; i < count; i++) {
+                    static_cast<GatewayPanel *>(events[i].data.ptr)->step(now);
+                    stepped++;
+                }
+
+                for (size_t p = shard; p < panels.size(); p += threads) {
+                    if (panels[p]->getWait(now) == 0) {
+                        panels[p]->step(now);
+                        stepped++;
+                    }
+                }
+
+                wakeups++;
+                steps += stepped;
+            }
+
+            close(epfd);
+        }
+};
+
+}  // namespace kyo_host
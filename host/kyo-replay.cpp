@@ -0,0 +1,198 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Link capture replay
+ * Loads the records of a dump_capture log (lines with "capture <base64>",
+ * any log prefix is skipped) and feeds them through the frame parser and
+ * the region decoders used on the device, printing the decoded state.
+ * With -r the capture is replayed the given number of times without
+ * output and the decoding speed is reported. Usage:
+ *   kyo-replay [-r repeat] [log file]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include "kyo-protocol.h"
+
+using namespace kyo_protocol;
+
+static const char *const RESULT_NAMES[RESULTS] = {"ok", "timeout", "short reply", "bad checksum"};
+
+static bool loadCapture(FILE *file, std::vector<CaptureRecord> &records) {
+    char line[1024];
+    CaptureRecord record;
+
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        const char *text = strstr(line, "capture ");
+
+        if (text == nullptr) {
+            continue;
+        }
+
+        if (parseCapture(text + strlen("capture "), record) == false) {
+            fprintf(stderr, "Invalid capture record: %s", line);
+            return (false);
+        }
+
+        records.push_back(record);
+    }
+
+    return (true);
+}
+
+// Region read up to its last byte by record (a region read in several frames is decoded with its last frame, as on the device)
+static bool isComplete(const CaptureRecord &record, RegionId id) {
+    uint32_t end = (record.request[1] | (record.request[2] << 8)) + record.request[3] + 1;
+
+    return ((record.request[0] == FRAME_READ) && (end >= static_cast<uint32_t>(REGION_MAP[id].addr + REGION_MAP[id].size)));
+}
+
+// Decode regions changed and completed by the last replayed record, counts decoded regions
+static size_t decodeRegions(PanelMemory &memory, const CaptureRecord &record, bool print) {
+    AlarmInfo info;
+    RealTimeStatus realTime;
+    Status status;
+    PinTable<KYO_STORED_PINS> pins;
+    uint8_t partsList;
+    bool ready[REGIONS];
+    size_t decoded = 0;
+
+    for (int id = 0; id < REGIONS; id++) {
+        ready[id] = memory.isDirty(static_cast<RegionId>(id)) && isComplete(record, static_cast<RegionId>(id));
+    }
+
+    if (ready[REGION_ALARM_INFO] && decodeAlarmInfo(memory.getData(REGION_ALARM_INFO), memory.getSize(REGION_ALARM_INFO), info)) {
+        decoded++;
+        if (print) {
+            printf("    model %s, firmware %s\n", info.model, info.firmware);
+        }
+    }
+
+    if (ready[REGION_PARTITIONS] && decodePartitionsList(memory.getData(REGION_PARTITIONS), memory.getSize(REGION_PARTITIONS), partsList)) {
+        decoded++;
+        if (print) {
+            printf("    partitions %02x\n", partsList);
+        }
+    }
+
+    if (ready[REGION_PINS]) {
+        pins.load(memory.getData(REGION_PINS), memory.getSize(REGION_PINS));
+        decoded++;
+        if (print) {
+            printf("    %u PINs\n", static_cast<unsigned>(pins.getSize()));
+        }
+    }
+
+    if (ready[REGION_REAL_TIME_STATUS] &&
+        decodeRealTimeStatus(memory.getData(REGION_REAL_TIME_STATUS), memory.getSize(REGION_REAL_TIME_STATUS), realTime)) {
+        decoded++;
+        if (print) {
+            printf("    zones %08x, tampers %08x, alarms %02x, warnings %02x, tamper flags %02x\n", static_cast<unsigned>(realTime.zones),
+                   static_cast<unsigned>(realTime.tampers), realTime.alarms, realTime.warnings, realTime.tamperFlags);
+        }
+    }
+
+    if (ready[REGION_STATUS] && decodeStatus(memory.getData(REGION_STATUS), memory.getSize(REGION_STATUS), status)) {
+        decoded++;
+        if (print) {
+            printf("    armed %02x/%02x/%02x, disarmed %02x, outputs %02x, bypassed %08x, alarm memory %08x, tamper memory %08x\n",
+                   status.armedAway, status.armedStay, status.armedStay0, status.disarmed, status.outputs, static_cast<unsigned>(status.bypassed),
+                   static_cast<unsigned>(status.alarmMemory), static_cast<unsigned>(status.tamperMemory));
+        }
+    }
+
+    for (int id = 0; id < REGIONS; id++) {
+        if (ready[id] == true) {
+            memory.clearDirty(static_cast<RegionId>(id));
+        }
+    }
+
+    return (decoded);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<CaptureRecord> records;
+    FrameParser parser;
+    PanelMemory memory;
+    long repeat = 0;
+    FILE *file = stdin;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r') {
+            repeat = atol(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-r repeat] [log file]\n", argv[0]);
+            return (1);
+        }
+    }
+
+    if ((optind < argc) && ((file = fopen(argv[optind], "r")) == nullptr)) {
+        perror(argv[optind]);
+        return (1);
+    }
+
+    if ((loadCapture(file, records) == false) || records.empty()) {
+        fprintf(stderr, "No capture records\n");
+        return (1);
+    }
+
+    if (repeat == 0) {
+        for (const CaptureRecord &record: records) {
+            Result result = replay(record, parser, memory);
+
+            printf("%10u ms  %02x %02x%02x  %-12s (captured %s), %u discarded bytes\n", static_cast<unsigned>(record.start), record.request[0],
+                   record.request[2], record.request[1], RESULT_NAMES[result], RESULT_NAMES[record.result],
+                   static_cast<unsigned>(parser.getDiscarded()));
+
+            // The decode path must give the result seen on the device
+            if (result != record.result) {
+                fprintf(stderr, "Replay result differs from the captured one\n");
+                return (1);
+            }
+
+            decodeRegions(memory, record, true);
+        }
+
+        return (0);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t decoded = 0;
+
+    for (long i = 0; i < repeat; i++) {
+        for (const CaptureRecord &record: records) {
+            replay(record, parser, memory);
+            decoded += decodeRegions(memory, record, false);
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double frames = static_cast<double>(repeat) * records.size();
+
+    printf("%.0f frames, %u regions decoded in %.3f s: %.0f frames/s, %.1f ns/frame\n", frames, static_cast<unsigned>(decoded), elapsed,
+           frames / elapsed, 1e9 * elapsed / frames);
+    return (0);
+}
@@ -0,0 +1,102 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Standalone KYO panel simulator
+ * Serves a simulated panel on a pty until interrupted, the pty path is
+ * printed on stdout. Usage:
+ *   kyo-simulator [-m model] [-b baud] [-d delay_ms] [-j jitter_ms] [-f fault_rate_%] [-p pin]
+ */
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "kyo-simulator.h"
+
+static volatile sig_atomic_t stopped = 0;
+
+static void onSignal(int) {
+    stopped = 1;
+}
+
+int main(int argc, char *argv[]) {
+    kyo_host::SimulatorConfig config;
+    const char *pin = "123456";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:b:d:j:f:p:")) != -1) {
+        switch (opt) {
+            case 'm':
+                config.model = kyo_protocol::parseModel(optarg);
+                if (config.model == kyo_protocol::AlarmModel::UNKNOWN) {
+                    fprintf(stderr, "Unknown model %s\n", optarg);
+                    return (1);
+                }
+                break;
+
+            case 'b':
+                config.baudRate = atoi(optarg);
+                break;
+
+            case 'd':
+                config.replyDelay = atoi(optarg);
+                break;
+
+            case 'j':
+                config.jitter = atoi(optarg);
+                break;
+
+            case 'f':
+                config.faultRate = atoi(optarg);
+                break;
+
+            case 'p':
+                pin = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-m model] [-b baud] [-d delay_ms] [-j jitter_ms] [-f fault_rate_%%] [-p pin]\n", argv[0]);
+                return (1);
+        }
+    }
+
+    kyo_host::PanelSimulator simulator(config);
+
+    simulator.setPin(0, pin);
+
+    if (simulator.start() == false) {
+        perror("Can't create pty");
+        return (1);
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    printf("%s\n", simulator.getPortName().c_str());
+    fflush(stdout);
+
+    while (stopped == 0) {
+        pause();
+    }
+
+    fprintf(stderr, "%u requests served\n", static_cast<unsigned>(simulator.getRequests()));
+    return (0);
+}
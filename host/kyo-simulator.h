@@ -0,0 +1,432 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * KYO panel simulator
+ * Emulates the memory map of a KYO4, KYO8 or KYO32 panel behind a
+ * pseudo-terminal: requests are echoed, reads are answered from the
+ * memory map and writes change it like the panel does. Bytes are sent
+ * with the timing of a 9600 baud 8E1 line, replies can be delayed by a
+ * random jitter and faults can be injected, at random or on demand.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "kyo-protocol.h"
+#include "kyo-tty.h"
+
+namespace kyo_host {
+
+enum class Fault {NONE, NO_ECHO, NO_REPLY, BAD_CHECKSUM, SHORT_REPLY, NOISE, FAULTS};
+
+struct SimulatorConfig {
+    kyo_protocol::AlarmModel model = kyo_protocol::AlarmModel::KYO_32;
+    uint32_t baudRate = 9600;       // Line speed, 0 sends bytes without delay
+    uint32_t replyDelay = 2;        // Time from request to echo (ms)
+    uint32_t jitter = 0;            // Maximum random delay added to replyDelay (ms)
+    uint32_t commandDelay = 0;      // Time partitions commands take to change the status (ms)
+    uint8_t faultRate = 0;          // Requests answered with a random fault (%)
+    uint32_t seed = 1;
+};
+
+class PanelSimulator {
+    public:
+        explicit PanelSimulator(const SimulatorConfig &config = SimulatorConfig()) : config(config), random(config.seed) {
+            reset();
+        }
+
+        ~PanelSimulator() {
+            stop();
+
+            if (slave >= 0) {
+                ::close(slave);
+            }
+
+            if (master >= 0) {
+                ::close(master);
+            }
+        }
+
+        PanelSimulator(const PanelSimulator &) = delete;
+        PanelSimulator &operator=(const PanelSimulator &) = delete;
+
+        // Create the pty and serve requests on a thread, getPortName() is the device to open
+        bool start() {
+            master = posix_openpt(O_RDWR | O_NOCTTY);
+
+            if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0)) {
+                return (false);
+            }
+
+            portName = ptsname(master);
+
+            // Keep the slave open, so the master does not hang up between clients
+            slave = ::open(portName.c_str(), O_RDWR | O_NOCTTY);
+            if ((slave < 0) || (setRawMode(slave) == false)) {
+                return (false);
+            }
+
+            fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+            running = true;
+            worker = std::thread(&PanelSimulator::run, this);
+            return (true);
+        }
+
+        void stop() {
+            running = false;
+
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+
+        const std::string &getPortName() const {
+            return (portName);
+        }
+
+        // Panel memory map back to the model defaults, all partitions disarmed
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            const char *model = getModelName(config.model);
+            uint8_t parts = (kyo_protocol::getModelZones(config.model) > 8) ? 0xff : 0x0f;
+
+            memory.assign(0x10000, 0x00);
+            memset(&memory[0x0000], ' ', kyo_protocol::REGION_MAP[kyo_protocol::REGION_ALARM_INFO].size);
+            memcpy(&memory[0x0000], model, strlen(model));
+            memcpy(&memory[0x0008], "2.13", 4);
+            memory[0x0200] = parts;
+            memset(&memory[kyo_protocol::REGION_MAP[kyo_protocol::REGION_PINS].addr], 0xff, kyo_protocol::REGION_MAP[kyo_protocol::REGION_PINS].size);
+            status()[kyo_protocol::ST_DISARMED] = parts;
+            pendingCommands.clear();
+            requests = 0;
+        }
+
+        // Store a PIN (4 - 6 digits) in a slot
+        void setPin(size_t slot, const std::string &pin) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint32_t pinCode = 0;
+            uint8_t *data = &memory[kyo_protocol::REGION_MAP[kyo_protocol::REGION_PINS].addr + 3 * slot];
+
+            kyo_protocol::encodePin(pin, pinCode);
+            data[0] = pinCode >> 16;
+            data[1] = (pinCode >> 8) & 0xff;
+            data[2] = pinCode & 0xff;
+        }
+
+        void setZones(uint32_t zones) {
+            std::lock_guard<std::mutex> lock(mutex);
+            setMask(&realTime()[kyo_protocol::RT_ZONES], zones);
+        }
+
+        void setTampers(uint32_t tampers) {
+            std::lock_guard<std::mutex> lock(mutex);
+            setMask(&realTime()[kyo_protocol::RT_TAMPERS], tampers);
+        }
+
+        // Partitions in alarm, zones in alarm memory
+        void setAlarms(uint8_t alarms, uint32_t alarmMemory = 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            realTime()[kyo_protocol::RT_ALARMS] = alarms;
+            setMask(&status()[kyo_protocol::ST_ALARM_MEMORY], getMask(&status()[kyo_protocol::ST_ALARM_MEMORY]) | alarmMemory);
+        }
+
+        void setTamperFlags(uint8_t flags) {
+            std::lock_guard<std::mutex> lock(mutex);
+            realTime()[kyo_protocol::RT_TAMPER_FLAGS] = flags;
+        }
+
+        void setOutputs(uint8_t outputs) {
+            std::lock_guard<std::mutex> lock(mutex);
+            status()[kyo_protocol::ST_OUTPUTS] = outputs;
+        }
+
+        // While offline requests are ignored, as with a disconnected cable
+        void setOnline(bool online) {
+            offline = !online;
+        }
+
+        // Answer the next requests with the given fault
+        void injectFault(Fault fault, size_t count = 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            faults.insert(faults.end(), count, fault);
+        }
+
+        kyo_protocol::Status getStatus() {
+            std::lock_guard<std::mutex> lock(mutex);
+            kyo_protocol::Status decoded = {};
+
+            applyCommands();
+            kyo_protocol::decodeStatus(status(), kyo_protocol::REGION_MAP[kyo_protocol::REGION_STATUS].size, decoded);
+            return (decoded);
+        }
+
+        // Requests received (with a valid header) since reset
+        uint32_t getRequests() const {
+            return (requests);
+        }
+
+        static const char *getModelName(kyo_protocol::AlarmModel model) {
+            switch (model) {
+                case kyo_protocol::AlarmModel::KYO_4: return (KYO_MODEL_4);
+                case kyo_protocol::AlarmModel::KYO_8: return (KYO_MODEL_8);
+                case kyo_protocol::AlarmModel::KYO_8G: return (KYO_MODEL_8G);
+                case kyo_protocol::AlarmModel::KYO_32G: return (KYO_MODEL_32G);
+                case kyo_protocol::AlarmModel::KYO_8W: return (KYO_MODEL_8W);
+                case kyo_protocol::AlarmModel::KYO_8GW: return (KYO_MODEL_8GW);
+                default: return (KYO_MODEL_32);
+            }
+        }
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        // Partitions command applied to the status after commandDelay
+        struct PendingCommand {
+            Clock::time_point due;
+            uint8_t data[kyo_protocol::getDataSize(kyo_protocol::CMD_CTRL_PARTITIONS)];
+        };
+
+        SimulatorConfig config;
+        std::mt19937 random;
+        std::mutex mutex;
+        std::vector<uint8_t> memory;
+        std::deque<PendingCommand> pendingCommands;
+        std::deque<Fault> faults;
+        std::atomic<uint32_t> requests{0};
+        std::atomic<bool> offline{false};
+        std::atomic<bool> running{false};
+        std::thread worker;
+        std::string portName;
+        int master = -1;
+        int slave = -1;
+        std::vector<uint8_t> rx;
+
+        uint8_t *realTime() {
+            return (&memory[kyo_protocol::REGION_MAP[kyo_protocol::REGION_REAL_TIME_STATUS].addr]);
+        }
+
+        uint8_t *status() {
+            return (&memory[kyo_protocol::REGION_MAP[kyo_protocol::REGION_STATUS].addr]);
+        }
+
+        static void setMask(uint8_t *data, uint32_t mask) {
+            for (int i = 0; i < 4; i++) {
+                data[i] = (mask >> (24 - 8 * i)) & 0xff;
+            }
+        }
+
+        static uint32_t getMask(const uint8_t *data) {
+            return (kyo_protocol::getMask(data));
+        }
+
+        void run() {
+            uint8_t buffer[64];
+
+            while (running == true) {
+                struct pollfd pfd = {master, POLLIN, 0};
+
+                if (::poll(&pfd, 1, 10) <= 0) {
+                    continue;
+                }
+
+                ssize_t size = ::read(master, buffer, sizeof(buffer));
+                if (size <= 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    continue;
+                }
+
+                if (offline == false) {
+                    rx.insert(rx.end(), buffer, buffer + size);
+                    processRequests();
+                } else {
+                    rx.clear();
+                }
+            }
+        }
+
+        // Answer all complete requests received, bytes before a valid header are skipped
+        void processRequests() {
+            while (rx.size() >= kyo_protocol::HEADER_SIZE) {
+                kyo_protocol::Command command = {rx[0], static_cast<uint16_t>(rx[1] | (rx[2] << 8)), rx[3], 0};
+                size_t size = kyo_protocol::getRequestSize(command);
+
+                if (((rx[0] != kyo_protocol::FRAME_READ) && (rx[0] != kyo_protocol::FRAME_WRITE) && (rx[0] != kyo_protocol::FRAME_CLOSE)) ||
+                    (rx[4] != 0x00) || (rx[5] != kyo_protocol::getHeaderChecksum(command))) {
+                    rx.erase(rx.begin());
+                    continue;
+                }
+
+                if (rx.size() < size) {
+                    return;
+                }
+
+                std::vector<uint8_t> request(rx.begin(), rx.begin() + size);
+                rx.erase(rx.begin(), rx.begin() + size);
+                requests++;
+                answer(command, request);
+            }
+        }
+
+        void answer(const kyo_protocol::Command &command, const std::vector<uint8_t> &request) {
+            std::vector<uint8_t> reply;
+            Fault fault = nextFault();
+            uint32_t delay = config.replyDelay;
+
+            if (config.jitter > 0) {
+                delay += std::uniform_int_distribution<uint32_t>(0, config.jitter)(random);
+            }
+
+            if (fault == Fault::NO_ECHO) {
+                return;
+            }
+
+            if (command.cmd == kyo_protocol::FRAME_READ) {
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t size = kyo_protocol::getDataSize(command);
+
+                applyCommands();
+                reply.assign(&memory[command.addr], &memory[command.addr] + std::min(size, memory.size() - command.addr));
+                reply.push_back(kyo_protocol::getChecksum(reply.data(), reply.size()));
+            } else if (command.cmd == kyo_protocol::FRAME_WRITE) {
+                const uint8_t *data = &request[kyo_protocol::HEADER_SIZE];
+                size_t size = kyo_protocol::getDataSize(command);
+
+                // A data block with a bad checksum is echoed and ignored
+                if (kyo_protocol::getChecksum(data, size) == data[size]) {
+                    write(command, data);
+                }
+            }
+
+            switch (fault) {
+                case Fault::NO_REPLY:
+                    reply.clear();
+                    break;
+
+                case Fault::BAD_CHECKSUM:
+                    if (reply.empty() == false) {
+                        reply.back() ^= 0x5a;
+                    }
+                    break;
+
+                case Fault::SHORT_REPLY:
+                    reply.resize(reply.size() / 2);
+                    break;
+
+                default:
+                    break;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+
+            if (fault == Fault::NOISE) {
+                // Garbage and a partial echo before the real one
+                const uint8_t noise[] = {0x00, request[0], 0xff, request[0], request[1]};
+
+                send(noise, sizeof(noise));
+            }
+
+            send(request.data(), request.size());
+            send(reply.data(), reply.size());
+        }
+
+        void write(const kyo_protocol::Command &command, const uint8_t *data) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (command.addr == kyo_protocol::CMD_CTRL_PARTITIONS.addr) {
+                PendingCommand pending;
+
+                pending.due = Clock::now() + std::chrono::milliseconds(config.commandDelay);
+                memcpy(pending.data, data, sizeof(pending.data));
+                pendingCommands.push_back(pending);
+            } else if (command.addr == kyo_protocol::CMD_ZONE_BYPASS.addr) {
+                uint32_t bypassed = getMask(&status()[kyo_protocol::ST_BYPASSED]);
+
+                bypassed = (bypassed | getMask(&data[0])) & ~getMask(&data[4]);
+                setMask(&status()[kyo_protocol::ST_BYPASSED], bypassed);
+            } else if (command.addr == kyo_protocol::CMD_RESET.addr) {
+                realTime()[kyo_protocol::RT_ALARMS] &= ~data[0];
+                setMask(&status()[kyo_protocol::ST_ALARM_MEMORY], 0);
+                setMask(&status()[kyo_protocol::ST_TAMPER_MEMORY], 0);
+            }
+        }
+
+        // Arm away, stay and stay 0 delay bytes, then disarm byte, as in the status region
+        void applyCommands() {
+            while ((pendingCommands.empty() == false) && (pendingCommands.front().due <= Clock::now())) {
+                const uint8_t *data = pendingCommands.front().data;
+                uint8_t *armed = &status()[kyo_protocol::ST_ARMED];
+                uint8_t arm = data[0] | data[1] | data[2];
+
+                for (int i = 0; i < 3; i++) {
+                    armed[i] = (armed[i] & ~(arm | data[3])) | data[i];
+                }
+
+                status()[kyo_protocol::ST_DISARMED] = (status()[kyo_protocol::ST_DISARMED] & ~arm) | data[3];
+                pendingCommands.pop_front();
+            }
+        }
+
+        Fault nextFault() {
+            std::lock_guard<std::mutex> lock(mutex);
+            Fault fault = Fault::NONE;
+
+            if (faults.empty() == false) {
+                fault = faults.front();
+                faults.pop_front();
+            } else if ((config.faultRate > 0) && (std::uniform_int_distribution<int>(0, 99)(random) < config.faultRate)) {
+                fault = static_cast<Fault>(std::uniform_int_distribution<int>(1, static_cast<int>(Fault::FAULTS) - 1)(random));
+            }
+
+            return (fault);
+        }
+
+        // Send bytes with the line timing, 11 bits per byte (8E1)
+        void send(const uint8_t *data, size_t size) {
+            Clock::time_point next = Clock::now();
+
+            for (size_t i = 0; i < size; i++) {
+                if (config.baudRate > 0) {
+                    next += std::chrono::microseconds(11000000 / config.baudRate);
+                    std::this_thread::sleep_until(next);
+                }
+
+                while (::write(master, &data[i], 1) != 1) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+};
+
+}  // namespace kyo_host
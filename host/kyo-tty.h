@@ -0,0 +1,165 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Host serial transport
+ * Serial devices and pseudo-terminals as a kyo_protocol::Link transport,
+ * plus the monotonic millisecond clock the link expects. Linux only.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace kyo_host {
+
+// Monotonic time in ms, wraps around like millis() on the ESP
+inline uint32_t getMillis() {
+    return (static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count()));
+}
+
+inline uint32_t getMicros() {
+    return (static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count()));
+}
+
+// Raw mode, reads never block, then 8E1 as the alarm serial port (ptys may reject line settings, they have no line)
+inline bool setRawMode(int fd, speed_t speed = B9600) {
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) != 0) {
+        return (false);
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+        return (false);
+    }
+
+    tio.c_cflag |= PARENB;
+    tio.c_cflag &= ~PARODD;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tcsetattr(fd, TCSANOW, &tio);
+
+    return (true);
+}
+
+/*
+ * TTY transport
+ * Non-blocking file descriptor with a small receive buffer, providing
+ * available(), read() and write_array() like the ESPHome UARTDevice.
+ * The descriptor is closed by the transport.
+ */
+class TtyTransport {
+    public:
+        explicit TtyTransport(int handle = -1) : fd(handle) {}
+
+        ~TtyTransport() {
+            close();
+        }
+
+        TtyTransport(const TtyTransport &) = delete;
+        TtyTransport &operator=(const TtyTransport &) = delete;
+
+        // Open a serial device or a pty slave in raw mode
+        bool open(const char *path) {
+            close();
+            fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+            if ((fd >= 0) && (setRawMode(fd) == false)) {
+                close();
+            }
+
+            return (fd >= 0);
+        }
+
+        void close() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+
+            fd = -1;
+            rxPos = 0;
+            rxSize = 0;
+        }
+
+        int available() {
+            if ((rxPos == rxSize) && (fd >= 0)) {
+                ssize_t size = ::read(fd, rx, sizeof(rx));
+
+                rxPos = 0;
+                rxSize = (size > 0) ? static_cast<size_t>(size) : 0;
+            }
+
+            return (static_cast<int>(rxSize - rxPos));
+        }
+
+        uint8_t read() {
+            return ((available() > 0) ? rx[rxPos++] : 0);
+        }
+
+        void write_array(const uint8_t *data, size_t size) {
+            while ((size > 0) && (fd >= 0)) {
+                ssize_t written = ::write(fd, data, size);
+
+                if (written > 0) {
+                    data += written;
+                    size -= written;
+                } else {
+                    struct pollfd pfd = {fd, POLLOUT, 0};
+                    ::poll(&pfd, 1, 10);
+                }
+            }
+        }
+
+        // Wait up to timeout ms for received bytes
+        bool wait(int timeout) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+
+            return ((rxPos < rxSize) || (::poll(&pfd, 1, timeout) > 0));
+        }
+
+        int getFd() const {
+            return (fd);
+        }
+
+        bool isOpen() const {
+            return (fd >= 0);
+        }
+
+    private:
+        int fd;
+        uint8_t rx[64];
+        size_t rxPos = 0;
+        size_t rxSize = 0;
+};
+
+}  // namespace kyo_host
@@ -16,565 +16,1560 @@
 * SPDX-License-Identifier: GPL-3.0-or-later
 */
 
-#include <sstream>
 #include "esphome.h"
+#include "kyo-protocol.h"
+
+#ifdef USE_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
 
 #define LOG_TAG "esp-key-alarm"
 
-#define UPDATE_INT_MS 2000
-
-#define KYO_MODEL_4   "KYO4"
-#define KYO_MODEL_8   "KYO8"
-#define KYO_MODEL_8G  "KYO8G"
-#define KYO_MODEL_32  "KYO32"
-#define KYO_MODEL_32G "KYO32G"
-#define KYO_MODEL_8W  "KYO8 W"
-#define KYO_MODEL_8GW "KYO8G W"
-
-#define KYO_MAX_ZONES 32
-
-#define KYO_STORED_PINS 63
-
-/* 
- * Kyo Protocol
- * ESP8266 and Kyo are little-endian
- * Request format: <cmd><addr><len><data><cksum>
- * uint8_t cmd: 0xf0 - read, 0x0f - write
- * uint16_t addr
- * uint16_t length - 2
- * variable data
- * uint8_t cksum % 0xff
- */
+// Link statistics publishing interval
+#define UPDATE_INT_MS 10000
+
+// Default poll intervals
+#define POLL_DISCOVERY_INT_MS 1000
+#define POLL_REAL_TIME_INT_MS 1000
+#define POLL_REAL_TIME_FAST_INT_MS 250
+#define POLL_STATUS_INT_MS 2000
+#define POLL_ACTIVITY_HOLD_MS 10000
+#define POLL_PINS_INT_MS 600000
+
+// Arm/disarm read-back: status poll interval and time the alarm has to confirm the command
+#define COMMAND_CONFIRM_INT_MS 100
+#define COMMAND_CONFIRM_TIMEOUT_MS 3000
+
+// Zone entities published per loop
+#define PUBLISH_BATCH 8
+
+// Event journal size (bytes), about 1000 zone changes, and events streamed per loop
+#ifndef KYO_JOURNAL_SIZE
+#define KYO_JOURNAL_SIZE 2048
+#endif
+#define JOURNAL_STREAM_BATCH 4
+
+// Panel clock is written only when off by more than this (s)
+#define CLOCK_DRIFT_THRESHOLD_S 30
+
+// Maximum number of queued requests
+#define TX_QUEUE_SIZE 8
+
+// Time zone bypass changes are collected before being written
+#define BYPASS_HOLD_MS 50
+
+// Maximum number of read frames of a poll task
+#define READ_PLAN_FRAMES 4
+
+// Consecutive failed requests before the link is considered down
+#define LINK_DOWN_FAILURES 3
+
+// Probe interval while the link is down, doubled after each failed probe
+#define LINK_PROBE_MIN_MS 1000
+#define LINK_PROBE_MAX_MS 16000
 
-class KyoAlarmComponent : public esphome::PollingComponent, public uart::UARTDevice, public api::CustomAPIDevice {
+// Link capture buffer size (bytes), about 50 status polls
+#ifndef KYO_CAPTURE_SIZE
+#define KYO_CAPTURE_SIZE 2048
+#endif
+
+// Link task stack (bytes) and priority, ESP32 only (above the loop task)
+#define LINK_TASK_STACK 4096
+#define LINK_TASK_PRIORITY 5
+
+/*
+ * KYO alarm component
+ * Caps (kyo_protocol::Capabilities) sets the zones, partitions and PIN
+ * slots handled, KyoAlarmComponent is the instance selected by KYO_PANEL.
+ */
+template<typename Caps>
+class KyoAlarm : public esphome::PollingComponent, public uart::UARTDevice, public api::CustomAPIDevice {
     public:
+        static constexpr size_t ZONES = Caps::ZONES;
+
         TextSensor *alarmStatusSensor = new TextSensor();
         TextSensor *modelSensor = new TextSensor();
         TextSensor *firmwareSensor = new TextSensor();
-        BinarySensor *zoneSensor = new BinarySensor[KYO_MAX_ZONES];
-        BinarySensor *zTamperSensor = new BinarySensor[KYO_MAX_ZONES];
+        TextSensor *linkStatusSensor = new TextSensor();
+        TextSensor *packedStateSensor = new TextSensor();
+        BinarySensor zoneSensor[ZONES];
+        BinarySensor zTamperSensor[ZONES];
+        BinarySensor zAlarmMemorySensor[ZONES];
+        BinarySensor zTamperMemorySensor[ZONES];
         Sensor *warningSensor = new Sensor();
         Sensor *tamperSensor = new Sensor();
+        Sensor *outputsSensor = new Sensor();
+        Sensor *linkUsageSensor = new Sensor();
+        Sensor *queueDepthSensor = new Sensor();
+        Sensor *queueWaitSensor = new Sensor();
+        Sensor *linkErrorsSensor = new Sensor();
+        Sensor *latencySensor = new Sensor();
+        Sensor *bytesInSensor = new Sensor();
+        Sensor *bytesOutSensor = new Sensor();
+        Sensor *loopStallSensor = new Sensor();
+        // Time since the previous real-time read, an upper bound of the trigger detection delay
+        Sensor *triggerDelayBoundSensor = new Sensor();
+        Sensor *clockDriftSensor = new Sensor();
         std::vector<switch_::Switch *> zoneSwitches;
 
-        KyoAlarmComponent(UARTComponent *parent) : UARTDevice(parent) {}
+        KyoAlarm(UARTComponent *parent) : UARTDevice(parent) {
+            scheduler.setInterval(POLL_DISCOVERY, POLL_DISCOVERY_INT_MS);
+            scheduler.setInterval(POLL_REAL_TIME_STATUS, POLL_REAL_TIME_INT_MS);
+            scheduler.setInterval(POLL_STATUS, POLL_STATUS_INT_MS);
+            scheduler.setInterval(POLL_PINS, POLL_PINS_INT_MS);
+        }
+
+        // Real-time status poll interval when idle and when armed or zones are changing (0 polls as fast as possible)
+        void setRealTimePollInterval(uint32_t interval, uint32_t fastInterval) {
+            scheduler.setInterval(POLL_REAL_TIME_STATUS, interval);
+            realTimeFastInterval = fastInterval;
+        }
+
+        // Partitions and bypass status poll interval
+        void setStatusPollInterval(uint32_t interval) {
+            scheduler.setInterval(POLL_STATUS, interval);
+        }
+
+        // Time real-time status is polled fast after last zone change
+        void setActivityHold(uint32_t hold) {
+            activityHold = hold;
+        }
+
+        // Cached PINs list refresh interval
+        void setPinsRefreshInterval(uint32_t interval) {
+            scheduler.setInterval(POLL_PINS, interval);
+        }
+
+        // Read the panel clock at address before setting it (otherwise written on every time sync), drift allowed before writing it (s)
+        void setClockSync(bool read, uint16_t address, uint32_t threshold) {
+            clockReadEnabled = read;
+            clockRead.addr = address;
+            clockThreshold = threshold;
+        }
+
+        // Publish zones, tampers, bypass and partitions masks as a single packed state entity
+        void setPackedState(bool enabled) {
+            packedState = enabled;
+        }
+
+        // Record link exchanges, dumped to log by the dump_capture service (on ESP32 set before setup() starts the link task)
+        void setCapture(bool enabled) {
+            if ((enabled == true) && (capture == nullptr)) {
+                capture = new Capture();
+            } else if ((enabled == false) && (capture != nullptr)) {
+                delete capture;
+                capture = nullptr;
+            }
+
+            link.setRecording((capture != nullptr) ? &capture->record : nullptr);
+        }
+
+        // Set up after the UART bus and before the API, so cached state is published to the first client
+        float get_setup_priority() const override {
+            return (setup_priority::DATA);
+        }
 
         void setup() override {
             set_update_interval(UPDATE_INT_MS);
-            set_setup_priority(setup_priority::AFTER_CONNECTION);
 
             // Register services
-            register_service(&KyoAlarmComponent::onAlarmDisarm, "disarm", {"code"});
-            register_service(&KyoAlarmComponent::onAlarmArmHome, "arm_home", {"code"});
-            register_service(&KyoAlarmComponent::onAlarmArmAway, "arm_away", {"code"});
-            register_service(&KyoAlarmComponent::onAlarmArmNight, "arm_night", {"code"});
-            register_service(&KyoAlarmComponent::onAlarmReset, "reset");
+            register_service(&KyoAlarm::onAlarmDisarm, "disarm", {"code"});
+            register_service(&KyoAlarm::onAlarmArmHome, "arm_home", {"code"});
+            register_service(&KyoAlarm::onAlarmArmAway, "arm_away", {"code"});
+            register_service(&KyoAlarm::onAlarmArmNight, "arm_night", {"code"});
+            register_service(&KyoAlarm::onAlarmReset, "reset");
+            register_service(&KyoAlarm::onDumpStats, "dump_stats");
+            register_service(&KyoAlarm::onDumpCapture, "dump_capture");
+            register_service(&KyoAlarm::onStreamJournal, "stream_journal");
 
             // Set initial state
-            alarmStatusSensor->publish_state("unavailable");
+            publishAlarmStatus(AlarmStatus::UNAVAILABLE);
+            linkStatusSensor->publish_state("healthy");
+            restoreCache();
+
+            // Plan read frames of each poll task
+            planReads(POLL_DISCOVERY, kyo_protocol::getRegionMask(kyo_protocol::REGION_ALARM_INFO) |
+                      kyo_protocol::getRegionMask(kyo_protocol::REGION_PARTITIONS), &KyoAlarm::onDiscoveryRead);
+            planReads(POLL_REAL_TIME_STATUS, kyo_protocol::getRegionMask(kyo_protocol::REGION_REAL_TIME_STATUS), &KyoAlarm::onRealTimeStatusRead);
+            planReads(POLL_STATUS, kyo_protocol::getRegionMask(kyo_protocol::REGION_STATUS), &KyoAlarm::onStatusRead);
+            planReads(POLL_PINS, kyo_protocol::getRegionMask(kyo_protocol::REGION_PINS) |
+                      kyo_protocol::getRegionMask(kyo_protocol::REGION_PARTITIONS), &KyoAlarm::onPinsListRead);
+
+            // All poll tasks are due at startup
+            scheduler.reset(millis());
+
+#ifdef USE_ESP32
+            xTaskCreate(&KyoAlarm::runLinkTask, "kyo_link", LINK_TASK_STACK, this, LINK_TASK_PRIORITY, nullptr);
+#endif
+
+            linkUsageStart = millis();
+        }
+
+        void loop() override {
+            uint32_t start = micros();
+
+            processLink();
+            flushBypass();
+            schedulePoll();
+            publishZones();
+            updateJournal();
+
+            loopStallMax = std::max(loopStallMax, micros() - start);
         }
 
         void update() override {
-            if (alarmModel == AlarmModel::UNKNOWN) {
-                getAlarmInfo();
-            } else if (partsList == 0) {
-                getPartitionsList();
-            } else {
-                static uint32_t tick = 0;
+            uint32_t now = millis();
+            uint32_t elapsed = now - linkUsageStart;
 
-                if ((tick++ % 2) == 0) {
-                    getStatus();
-                } else {
-                    getRealTimeStatus();
-                }
+            // Publish link usage since last update
+            if (elapsed > 0) {
+                linkUsageSensor->publish_state((100.0f * linkBusyTime) / elapsed);
             }
+
+            // Publish maximum queue depth and wait time since last update
+            queueDepthSensor->publish_state(txQueue.getDepthMax());
+            queueWaitSensor->publish_state(txQueue.getWaitMax());
+
+            // Publish link statistics, errors since boot, rates and average latency since last update
+            uint32_t completed = getLinkStats().getCount(kyo_protocol::RESULT_OK) - lastStats.completed;
+            uint32_t latencySum = getLinkStats().getLatencySum() - lastStats.latencySum;
+
+            linkErrorsSensor->publish_state(getLinkStats().getErrors());
+
+            if (completed > 0) {
+                latencySensor->publish_state(static_cast<float>(latencySum) / completed);
+            }
+
+            if (elapsed > 0) {
+                bytesInSensor->publish_state((1000.0f * (getLinkStats().getBytesIn() - lastStats.bytesIn)) / elapsed);
+                bytesOutSensor->publish_state((1000.0f * (getLinkStats().getBytesOut() - lastStats.bytesOut)) / elapsed);
+            }
+
+            loopStallSensor->publish_state(loopStallMax / 1000.0f);
+
+            linkBusyTime = 0;
+            linkUsageStart = now;
+            txQueue.resetStats();
+            lastStats = {getLinkStats().getCount(kyo_protocol::RESULT_OK), getLinkStats().getLatencySum(), getLinkStats().getBytesIn(), getLinkStats().getBytesOut()};
+            loopStallMax = 0;
         }
 
         void bypassZone(uint32_t zoneId, bool bypassFlag) {
-            std::vector<uint8_t> request = cmdZoneBypass;
-            std::vector<uint8_t> requestData = cmdZoneBypassData;
-            std::vector<uint8_t> requestClose = cmdClose;
-            std::vector<uint8_t> reply;
-            uint32_t data = 0;
+            uint32_t mask = 0;
 
             if(alarmStatus == AlarmStatus::DISARMED) {
-                data = 1 << zoneId;
+                mask = static_cast<uint32_t>(1) << zoneId;
 
+                // Changes are merged in a single write, the last one wins for each zone
                 if (bypassFlag == true) {
-                    requestData[0] = (data >> 24) & 0xff;
-                    requestData[1] = (data >> 16) & 0xff;
-                    requestData[2] = (data >> 8) & 0xff;
-                    requestData[3] = data & 0xff;
+                    bypassInclude |= mask;
+                    bypassExclude &= ~mask;
                 } else {
-                    requestData[4] = (data >> 24) & 0xff;
-                    requestData[5] = (data >> 16) & 0xff;
-                    requestData[6] = (data >> 8) & 0xff;
-                    requestData[7] = data & 0xff;
+                    bypassExclude |= mask;
+                    bypassInclude &= ~mask;
                 }
 
-                appendChecksum(request);
-                appendChecksum(requestData);
-                request.insert(request.end(), requestData.begin(), requestData.end());
-
-                if (sendRequest(request, reply, 100) && reply.size() == RPL_ZONE_BYPASS_SIZE) {
-                    appendChecksum(requestClose);
-                    sendRequest(requestClose, reply, 100);
-                } else {
-                    ESP_LOGE(LOG_TAG, "Bypass zone request failed");
-                }
+                bypassChanged = millis();
             }
         }
 
         void onTimeSync(esphome::ESPTime time) {
-            std::vector<uint8_t> request = cmdSetTime;
-            std::vector<uint8_t> requestData = cmdSetTimeData;
-            std::vector<uint8_t> requestClose = cmdClose;
-            std::vector<uint8_t> reply;
-
-            if (time.is_valid()) {
-                requestData[0] = time.day_of_month;
-                requestData[1] = time.month;
-                requestData[2] = static_cast<uint8_t>(time.year - 2000);
-                requestData[3] = time.hour;
-                requestData[4] = time.minute;
-                requestData[5] = time.second;
-
-                appendChecksum(request);
-                appendChecksum(requestData);
-                request.insert(request.end(), requestData.begin(), requestData.end());
-
-                if (sendRequest(request, reply, 100) && reply.size() == RPL_SET_TIME_SIZE) {
-                    appendChecksum(requestClose);
-                    sendRequest(requestClose, reply, 100);
-                } else {
-                    ESP_LOGE(LOG_TAG, "Set time request failed");
-                }
-            } else {
+            uint8_t data[kyo_protocol::CLOCK_SIZE] = {0};
+
+            data[0] = time.day_of_month;
+            data[1] = time.month;
+            data[2] = static_cast<uint8_t>(time.year - 2000);
+            data[3] = time.hour;
+            data[4] = time.minute;
+            data[5] = time.second;
+
+            if ((time.is_valid() == false) || (kyo_protocol::decodeClock(data, sizeof(data), clockReference) == false)) {
                 ESP_LOGE(LOG_TAG, "Invalid time");
+                return;
+            }
+
+            clockReferenceAt = millis();
+
+            // Read panel clock first when its address is known, write it only if off
+            if (clockReadEnabled == true) {
+                sendRequest(clockRead, &KyoAlarm::onClockReply);
+            } else {
+                sendRequest(kyo_protocol::CMD_SET_TIME, &KyoAlarm::onTimeSyncReply, data);
             }
         }
 
     private:
-        const std::vector<uint8_t> cmdGetAlarmInfo = {0xf0, 0x00, 0x00, 0x0b, 0x00};
-        const size_t RPL_GET_ALARM_INFO_SIZE = 13;
+        kyo_protocol::PanelMemory memory;
+        kyo_protocol::RealTimeStatus realTimeStatus = {};
+        kyo_protocol::Status partitionsStatus = {};
+        kyo_protocol::PinTable<Caps::PINS> pinTable;
+        uint8_t partsList = 0;
+
+        /*
+         * Panel cache
+         * Alarm info, partitions and PINs regions are kept in flash, so at boot
+         * model, partitions and PINs are known before the first read. Cached
+         * identity is used right away and verified by a discovery read. Cached
+         * PINs are not trusted for commands until the panel list has been read.
+         */
+        struct PanelCache {
+            uint8_t alarmInfo[kyo_protocol::REGION_MAP[kyo_protocol::REGION_ALARM_INFO].size];
+            uint8_t partitions[kyo_protocol::REGION_MAP[kyo_protocol::REGION_PARTITIONS].size];
+            uint8_t pins[kyo_protocol::REGION_MAP[kyo_protocol::REGION_PINS].size];
+        };
+
+        ESPPreferenceObject cachePref;
+        PanelCache cache = {};
+        bool discoveryVerified = false;
+        bool pinsVerified = false;
+
+        // Last stable alarm status (armed or disarmed), kept apart from the panel cache and published at boot until the first status read
+        ESPPreferenceObject statusPref;
+        uint8_t cachedStatus = 0;
+
+        // Last decoded states, only changes are published
+        kyo_protocol::MaskTracker zonesAlarm{Caps::ZONES_MASK};
+        kyo_protocol::MaskTracker zonesTamper{Caps::ZONES_MASK};
+        kyo_protocol::MaskTracker zonesBypass{Caps::ZONES_MASK};
+        kyo_protocol::MaskTracker zonesAlarmMemory{Caps::ZONES_MASK};
+        kyo_protocol::MaskTracker zonesTamperMemory{Caps::ZONES_MASK};
+        kyo_protocol::MaskTracker outputFlags;
+        kyo_protocol::MaskTracker warningFlags;
+        kyo_protocol::MaskTracker tamperFlags;
+
+        /*
+         * Zone entities publishing
+         * Read handlers only update the masks above and flag changed zones,
+         * loop() publishes at most PUBLISH_BATCH zone entities per run from
+         * the latest masks. A zone changed twice before being published is
+         * published once.
+         */
+        enum PublishId {PUBLISH_ZONE, PUBLISH_TAMPER, PUBLISH_BYPASS, PUBLISH_ALARM_MEMORY, PUBLISH_TAMPER_MEMORY, PUBLISHES};
+        uint32_t zonesPending[PUBLISHES] = {};
+
+        // Last published packed state, empty until all masks are known
+        bool packedState = false;
+        char packedStateText[kyo_protocol::PACKED_STATE_SIZE] = {};
+
+        typedef kyo_protocol::AlarmModel AlarmModel;
+        AlarmModel alarmModel = AlarmModel::UNKNOWN;
+
+        enum class AlarmStatus {UNAVAILABLE, PENDING, ARMING, ARMED_AWAY, ARMED_HOME, ARMED_NIGHT, DISARMED, TRIGGERED};
+        AlarmStatus alarmStatus = AlarmStatus::UNAVAILABLE;
 
-        const std::vector<uint8_t> cmdGetPinsList1 = {0xf0, 0xb4, 0x01, 0x3f, 0x00};
-        const size_t RPL_GET_PINS_LIST_1_SIZE = 65;
-        const std::vector<uint8_t> cmdGetPinsList2 = {0xf0, 0xf4, 0x01, 0x07, 0x00};
-        const size_t RPL_GET_PINS_LIST_2_SIZE = 9;
+        /*
+         * Link health
+         * Down after LINK_DOWN_FAILURES consecutive failures. While down,
+         * queued and new requests are dropped and only probe frames are sent,
+         * with exponential backoff. When a probe succeeds the alarm is
+         * discovered again and all entities are published again.
+         */
+        kyo_protocol::HealthMonitor linkHealth{LINK_DOWN_FAILURES, LINK_PROBE_MIN_MS, LINK_PROBE_MAX_MS};
+
+        /*
+         * Non-blocking transaction engine
+         * Requests are queued and processed by loop(), one at a time:
+         * send request -> wait for echo -> collect reply -> call completion handler
+         * Received bytes are consumed by the frame parser as they arrive, the
+         * transaction completes as soon as the expected reply length is received.
+         * The wait time is only a deadline, loop() never waits for the alarm.
+         * The queue is ordered by priority (see kyo_protocol::RequestQueue).
+         */
+        typedef void (KyoAlarm::*ReplyHandler)(bool success, const uint8_t *reply, size_t size);
+
+        typedef kyo_protocol::Priority Priority;
+
+        /*
+         * Read plans
+         * Each poll task reads a set of panel memory regions, planned at setup
+         * in the fewest read frames. Frames after the first one are queued with
+         * the plan priority, so alarm reads can cut in between them. The plan
+         * handler runs when all of them are stored in the memory mirror (or as
+         * soon as one fails).
+         */
+        typedef void (KyoAlarm::*ReadHandler)(bool success);
+
+        struct ReadPlan {
+            kyo_protocol::Command frames[READ_PLAN_FRAMES];
+            size_t count;
+            ReadHandler handler;
+        };
+
+        struct Transaction {
+            kyo_protocol::Frame request;
+            const kyo_protocol::Command *command;
+            ReplyHandler handler;
+            Priority priority;
+            uint32_t queued;
+            const ReadPlan *plan;
+            size_t frame;
+        };
+
+        // Exchanges over this UART, link statistics since boot included
+        typedef kyo_protocol::Link<uart::UARTDevice> SerialLink;
+        SerialLink link{*this};
+
+#ifdef USE_ESP32
+        // The link runs on its own task, started by setup(); last exchange handed back by the worker
+        kyo_protocol::LinkWorker<uart::UARTDevice> linkWorker{link};
+        kyo_protocol::LinkResult linkResult = {};
+        bool linkBusy = false;
+        bool linkSubmitted = false;
+#endif
+
+        // Reply handlers time, on the loop() side
+        kyo_protocol::HandlerStats handlerStats;
+
+        // Queue statistics are kept since last update
+        kyo_protocol::RequestQueue<Transaction, TX_QUEUE_SIZE> txQueue;
+        Transaction txCurrent;
+
+        // Link statistics at last update
+        struct {
+            uint32_t completed;
+            uint32_t latencySum;
+            uint32_t bytesIn;
+            uint32_t bytesOut;
+        } lastStats = {0, 0, 0, 0};
+
+        // Longest loop() run since last update (us)
+        uint32_t loopStallMax = 0;
+
+        // Link capture and the exchange being recorded, allocated only when enabled
+        struct Capture {
+            kyo_protocol::CaptureBuffer<KYO_CAPTURE_SIZE> buffer;
+            kyo_protocol::CaptureRecord record;
+        };
+
+        Capture *capture = nullptr;
+
+        // Zone bypass changes waiting to be written (bit 0 is zone 1)
+        uint32_t bypassInclude = 0;
+        uint32_t bypassExclude = 0;
+        uint32_t bypassChanged = 0;
+
+        /*
+         * Poll scheduler
+         * The PINs list refresh is an idle task (see kyo_protocol::PollScheduler).
+         * Discovery runs alone until model and partitions list are known,
+         * with a cached identity it runs once as an idle task to verify it.
+         */
+        enum PollTaskId {POLL_DISCOVERY, POLL_REAL_TIME_STATUS, POLL_STATUS, POLL_PINS, POLL_TASKS};
+
+        kyo_protocol::PollScheduler<POLL_TASKS> scheduler;
+
+        ReadPlan readPlans[POLL_TASKS];
+
+        uint32_t realTimeFastInterval = POLL_REAL_TIME_FAST_INT_MS;
+        uint32_t activityHold = POLL_ACTIVITY_HOLD_MS;
+        uint32_t lastActivity = 0;
+
+        // Start of last real-time status read, a trigger happened after it (valid after the first read since discovery)
+        uint32_t lastRealTimeRead = 0;
+        bool lastRealTimeValid = false;
+
+        // Link usage
+        uint32_t linkBusyTime = 0;
+        uint32_t linkUsageStart = 0;
+
+        // Command waiting for PINs list to be loaded
+        enum class Action {NONE, ARM_HOME, ARM_AWAY, ARM_NIGHT, DISARM};
+        Action pendingAction = Action::NONE;
+        uint32_t pendingPinCode = 0;
+
+        // Panel clock read, reference time (s from 2000) and when it was received
+        bool clockReadEnabled = false;
+        kyo_protocol::Command clockRead = {kyo_protocol::FRAME_READ, 0x0000, kyo_protocol::CLOCK_SIZE - 1, 100};
+        uint32_t clockThreshold = CLOCK_DRIFT_THRESHOLD_S;
+        uint32_t clockReference = 0;
+        uint32_t clockReferenceAt = 0;
+
+        /*
+         * Event journal
+         * Zone alarm, tamper and bypass changes and alarm status changes are
+         * kept in RAM, so they are not lost while Home Assistant is not
+         * connected. The stream_journal service sends the events not sent yet
+         * as esphome.kyo_event events, a few per loop.
+         */
+        typedef kyo_protocol::EventJournal<KYO_JOURNAL_SIZE> Journal;
+        Journal journal;
+        Journal::Cursor journalCursor = journal.begin();
+        bool journalStreaming = false;
+        AlarmStatus journalStatus = AlarmStatus::UNAVAILABLE;
+
+        // Command waiting for status read-back, partitions expected armed and disarmed
+        bool confirmPending = false;
+        bool confirmFailed = false;
+        uint8_t confirmArmed = 0;
+        uint8_t confirmDisarmed = 0;
+        uint32_t confirmStart = 0;
+        AlarmStatus confirmPrevious = AlarmStatus::UNAVAILABLE;
 
-        const std::vector<uint8_t> cmdGetPartitionsList = {0xf0, 0xff, 0x01, 0x01, 0x00};
-        const size_t RPL_GET_PARTITIONS_LIST_SIZE = 3;
+        void onAlarmReset() {
+            uint8_t data[kyo_protocol::getDataSize(kyo_protocol::CMD_RESET)] = {partsList, 0x00};
 
-        const std::vector<uint8_t> cmdGetRealTimeStatus = {0xf0, 0x04, 0xf0, 0x0a, 0x00};
-        const size_t RPL_GET_REAL_TIME_STATUS_SIZE = 12;
+            sendRequest(kyo_protocol::CMD_RESET, &KyoAlarm::onAlarmResetReply, data, Priority::COMMAND);
+        }
 
-        const std::vector<uint8_t> cmdGetStatus = {0xf0, 0x02, 0x15, 0x12, 0x00};
-        const size_t RPL_GET_STATUS_SIZE = 20;
+        void onAlarmResetReply(bool success, const uint8_t *reply, size_t size) {
+            if (success) {
+                // PINs may change after a reset
+                pinTable.invalidate();
+                sendClose();
+            } else {
+                ESP_LOGE(LOG_TAG, "Reset alarm request failed");
+            }
+        }
 
-        const std::vector<uint8_t> cmdCtrlPartitions = {0x0f, 0x00, 0xf0, 0x03, 0x00};
-        const std::vector<uint8_t> cmdCtrlPartitionsData = {0x00, 0x00, 0x00, 0x00};
-        const size_t RPL_CTRL_PARTITIONS_SIZE = 0;
+        void onStreamJournal() {
+            ESP_LOGI(LOG_TAG, "Streaming %u journal events", static_cast<unsigned>(journal.getUnread(journalCursor)));
+            journalStreaming = true;
+        }
 
-        const std::vector<uint8_t> cmdZoneBypass = {0x0f, 0x01, 0xf0, 0x07, 0x00};
-        const std::vector<uint8_t> cmdZoneBypassData = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-        const size_t RPL_ZONE_BYPASS_SIZE = 0;
+        // The first mask after boot or rediscovery is not a change, it is not journaled
+        void journalMask(kyo_protocol::EventType type, uint32_t changed, uint32_t mask) {
+            while (changed != 0) {
+                int i = kyo_protocol::popBit(changed);
+                journal.append(millis(), type, i, (mask >> i) & 0x01);
+            }
+        }
 
-        const std::vector<uint8_t> cmdSetTime = {0x0f, 0x03, 0xf0, 0x05, 0x00};
-        const std::vector<uint8_t> cmdSetTimeData = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-        const size_t RPL_SET_TIME_SIZE = 0;
+        void publishZones() {
+            int budget = PUBLISH_BATCH;
 
-        const std::vector<uint8_t> cmdReset = {0x0f, 0x05, 0xf0, 0x01, 0x00};
-        const std::vector<uint8_t> cmdResetData = {0xff, 0x00};
-        const size_t RPL_RESET_SIZE = 0;
+            for (int id = 0; (id < PUBLISHES) && (budget > 0); id++) {
+                while ((zonesPending[id] != 0) && (budget > 0)) {
+                    publishZone(static_cast<PublishId>(id), kyo_protocol::popBit(zonesPending[id]));
+                    budget--;
+                }
+            }
+        }
 
-        const std::vector<uint8_t> cmdClose = {0x3c, 0x03, 0x00, 0x00, 0x00};
-        const size_t RPL_CLOSE_SIZE = 0;
+        void publishZone(PublishId id, int zone) {
+            switch (id) {
+                case PUBLISH_ZONE:
+                    zoneSensor[zone].publish_state((zonesAlarm.getValue() >> zone) & 0x01);
+                    break;
 
-        uint8_t pinsList[KYO_STORED_PINS * 3] = {0};
-        uint8_t partsList = 0;
+                case PUBLISH_TAMPER:
+                    zTamperSensor[zone].publish_state((zonesTamper.getValue() >> zone) & 0x01);
+                    break;
 
-        enum class AlarmModel {UNKNOWN, KYO_4, KYO_8, KYO_8G, KYO_32, KYO_32G, KYO_8W, KYO_8GW};
-        AlarmModel alarmModel = AlarmModel::UNKNOWN;
+                case PUBLISH_BYPASS:
+                    if (static_cast<size_t>(zone) < zoneSwitches.size()) {
+                        zoneSwitches[zone]->publish_state((zonesBypass.getValue() >> zone) & 0x01);
+                    }
+                    break;
 
-        enum class AlarmStatus {UNAVAILABLE, PENDING, ARMING, ARMED_AWAY, ARMED_HOME, ARMED_NIGHT, DISARMED, TRIGGERED};
-        AlarmStatus alarmStatus = AlarmStatus::UNAVAILABLE;
+                case PUBLISH_ALARM_MEMORY:
+                    zAlarmMemorySensor[zone].publish_state((zonesAlarmMemory.getValue() >> zone) & 0x01);
+                    break;
 
-        void onAlarmReset() {
-            std::vector<uint8_t> request = cmdReset;
-            std::vector<uint8_t> requestData = cmdResetData;
-            std::vector<uint8_t> requestClose = cmdClose;
-            std::vector<uint8_t> reply;
+                case PUBLISH_TAMPER_MEMORY:
+                    zTamperMemorySensor[zone].publish_state((zonesTamperMemory.getValue() >> zone) & 0x01);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        // Publish packed state once both status regions are known, only when changed
+        void publishPackedState() {
+            char text[kyo_protocol::PACKED_STATE_SIZE];
+
+            if ((packedState == false) || (zonesAlarm.isValid() == false) || (zonesTamper.isValid() == false) ||
+                (zonesBypass.isValid() == false)) {
+                return;
+            }
+
+            kyo_protocol::encodePackedState(realTimeStatus, partitionsStatus, text);
+            if (strcmp(text, packedStateText) != 0) {
+                strcpy(packedStateText, text);
+                packedStateSensor->publish_state(packedStateText);
+            }
+        }
+
+        void updateJournal() {
+            kyo_protocol::Event event;
+
+            if (alarmStatus != journalStatus) {
+                journal.append(millis(), kyo_protocol::EVENT_STATUS, static_cast<uint8_t>(alarmStatus), true);
+                journalStatus = alarmStatus;
+            }
+
+            if (journalStreaming == false) {
+                return;
+            }
+
+            for (int i = 0; i < JOURNAL_STREAM_BATCH; i++) {
+                if (journal.next(journalCursor, event) == false) {
+                    journalStreaming = false;
+                    return;
+                }
 
-            requestData[0] = partsList;
+                sendEvent(event);
+            }
+        }
+
+        void sendEvent(const kyo_protocol::Event &event) {
+            static const char *const types[] = {"zone", "tamper", "bypass", "status"};
+            std::map<std::string, std::string> data;
 
-            appendChecksum(request);
-            appendChecksum(requestData);
-            request.insert(request.end(), requestData.begin(), requestData.end());
+            data["seq"] = to_string(event.seq);
+            data["age_ms"] = to_string(millis() - event.time);
+            data["type"] = types[event.type];
 
-            if (sendRequest(request, reply, 500) && reply.size() == RPL_RESET_SIZE) {
-                appendChecksum(requestClose);
-                sendRequest(requestClose, reply, 100);
+            if (event.type == kyo_protocol::EVENT_STATUS) {
+                data["state"] = getAlarmStatusName(static_cast<AlarmStatus>(event.index));
             } else {
-                ESP_LOGE(LOG_TAG, "Reset alarm request failed");
+                data["zone"] = to_string(event.index + 1);
+                data["state"] = event.value ? "on" : "off";
             }
+
+            fire_homeassistant_event("esphome.kyo_event", data);
+        }
+
+        void onDumpCapture() {
+            kyo_protocol::CaptureRecord record;
+            char text[kyo_protocol::CAPTURE_TEXT_SIZE];
+
+            if (capture == nullptr) {
+                ESP_LOGW(LOG_TAG, "Link capture not enabled");
+                return;
+            }
+
+            ESP_LOGI(LOG_TAG, "Link capture: %u records, %u dropped", static_cast<unsigned>(capture->buffer.getCount()),
+                     static_cast<unsigned>(capture->buffer.getDropped()));
+
+            // One base64 record per line, loaded back by kyo-replay
+            for (size_t i = 0; capture->buffer.read(i, record) == true; i++) {
+                kyo_protocol::formatCapture(record, text);
+                ESP_LOGI(LOG_TAG, "capture %s", text);
+            }
+
+            capture->buffer.clear();
+        }
+
+        void onDumpStats() {
+            for (int id = 0; id < kyo_protocol::STATS; id++) {
+                kyo_protocol::StatId stat = static_cast<kyo_protocol::StatId>(id);
+
+                ESP_LOGI(LOG_TAG, "%s: ok %u, timeout %u, short %u, checksum %u, handler avg %u us, max %u us", kyo_protocol::STAT_NAMES[id],
+                         static_cast<unsigned>(getLinkStats().getCount(stat, kyo_protocol::RESULT_OK)),
+                         static_cast<unsigned>(getLinkStats().getCount(stat, kyo_protocol::RESULT_TIMEOUT)),
+                         static_cast<unsigned>(getLinkStats().getCount(stat, kyo_protocol::RESULT_SHORT_REPLY)),
+                         static_cast<unsigned>(getLinkStats().getCount(stat, kyo_protocol::RESULT_BAD_CHECKSUM)),
+                         static_cast<unsigned>(handlerStats.getAverage(stat)),
+                         static_cast<unsigned>(handlerStats.getMax(stat)));
+            }
+
+            for (size_t i = 0; i < kyo_protocol::LATENCY_BUCKETS - 1; i++) {
+                ESP_LOGI(LOG_TAG, "Latency <= %u ms: %u", kyo_protocol::LATENCY_BOUNDS[i], static_cast<unsigned>(getLinkStats().getLatencyBucket(i)));
+            }
+
+            ESP_LOGI(LOG_TAG, "Latency > %u ms: %u", kyo_protocol::LATENCY_BOUNDS[kyo_protocol::LATENCY_BUCKETS - 2],
+                     static_cast<unsigned>(getLinkStats().getLatencyBucket(kyo_protocol::LATENCY_BUCKETS - 1)));
+            ESP_LOGI(LOG_TAG, "Bytes in %u, out %u", static_cast<unsigned>(getLinkStats().getBytesIn()), static_cast<unsigned>(getLinkStats().getBytesOut()));
         }
 
         void onAlarmDisarm(const std::string code) {
-            processCommandRequest("disarm", code);
+            processCommandRequest(Action::DISARM, code);
         }
 
         void onAlarmArmHome(const std::string code) {
-            processCommandRequest("arm_home", code);
+            processCommandRequest(Action::ARM_HOME, code);
         }
 
         void onAlarmArmAway(const std::string code) {
-            processCommandRequest("arm_away", code);
+            processCommandRequest(Action::ARM_AWAY, code);
         }
 
         void onAlarmArmNight(const std::string code) {
-            processCommandRequest("arm_night", code);
-        }
-
-        void processCommandRequest(const std::string action, const std::string code) {
-            std::vector<uint8_t> request = cmdCtrlPartitions;
-            std::vector<uint8_t> requestData = cmdCtrlPartitionsData;
-            std::vector<uint8_t> requestClose = cmdClose;
-            std::vector<uint8_t> reply;
-
-            // Verify PIN
-            if (verifyPin(code) == true) {
-                // Build request data
-                if (action == "arm_home") {
-                    // Arm home partitions request
-                    requestData[0] = armed_home->value() & partsList;
-                    alarmStatusSensor->publish_state("arming");
-                    alarmStatus = AlarmStatus::ARMING;
-                } else if (action == "arm_away") {
-                    // Arm away partitions request
-                    requestData[0] = armed_away->value() & partsList;
-                    alarmStatusSensor->publish_state("arming");
-                    alarmStatus = AlarmStatus::ARMING;
-                } else if (action == "arm_night") {
-                    // Arm night partitions request
-                    requestData[0] = armed_night->value() & partsList;
-                    alarmStatusSensor->publish_state("arming");
-                    alarmStatus = AlarmStatus::ARMING;
-                } else if (action == "disarm") {
-                    // Disarm partitions request
-                    requestData[3] = partsList;
-                    alarmStatusSensor->publish_state("pending");
-                    alarmStatus = AlarmStatus::PENDING;
-                } else {
-                    return;
-                }
+            processCommandRequest(Action::ARM_NIGHT, code);
+        }
 
-                appendChecksum(request);
-                appendChecksum(requestData);
-                request.insert(request.end(), requestData.begin(), requestData.end());
+        void processCommandRequest(Action action, const std::string &code) {
+            uint32_t pinCode = 0;
 
-                if (sendRequest(request, reply, 1000) && reply.size() == RPL_CTRL_PARTITIONS_SIZE) {
-                    appendChecksum(requestClose);
-                    sendRequest(requestClose, reply, 100);
-                } else {
-                    ESP_LOGE(LOG_TAG, "Process command request failed");
+            // Commands are dropped while the link is down, they must not run when it is restored
+            if (linkHealth.isDown() == true) {
+                ESP_LOGE(LOG_TAG, "Link down, command dropped");
+                return;
+            }
+
+            // Verify PIN format, PIN value is checked when PINs list is available
+            if (kyo_protocol::encodePin(code, pinCode) == true) {
+                pendingAction = action;
+                pendingPinCode = pinCode;
+
+                // PINs restored from flash may be stale, the command waits for the panel list
+                if ((pinTable.isValid() == true) && (pinsVerified == true)) {
+                    onPinsListCompleted(true);
+                } else if (sendRead(readPlans[POLL_PINS], Priority::COMMAND) == false) {
+                    // PINs list read not queued, the command is dropped
+                    pendingAction = Action::NONE;
                 }
+            } else {
+                ESP_LOGE(LOG_TAG, "Invalid PIN provided.");
             }
         }
 
-        bool getAlarmInfo() {
-            std::vector<uint8_t> request = cmdGetAlarmInfo;
-            std::vector<uint8_t> reply;
+        void onPinsListCompleted(bool success) {
+            Action action = pendingAction;
 
-            appendChecksum(request);
+            pendingAction = Action::NONE;
 
-            if (sendRequest(request, reply, 100) && reply.size() == RPL_GET_ALARM_INFO_SIZE) {
-                // Parse reply
-                std::ostringstream convert;
-                for (int i = 0; i < RPL_GET_ALARM_INFO_SIZE - 1; i++) {
-                    convert << reply[i];
-                }
+            if (action == Action::NONE) {
+                return;
+            }
 
-                // Trim spaces from model sub-string
-                std::string model = convert.str().substr(0, 7);
-                rtrim(model);
+            if ((success == false) || (pinTable.contains(pendingPinCode) == false)) {
+                ESP_LOGW(LOG_TAG, "Unknown PIN provided.");
+                return;
+            }
 
-                // Trim spaces from firmware substring
-                std::string firmware = convert.str().substr(8, 11);
-                rtrim(firmware);
+            executeCommand(action);
+        }
 
-                modelSensor->publish_state(model.c_str());
-                firmwareSensor->publish_state(firmware.c_str());
+        void executeCommand(Action action) {
+            uint8_t data[kyo_protocol::getDataSize(kyo_protocol::CMD_CTRL_PARTITIONS)] = {0};
+            AlarmStatus requested = AlarmStatus::ARMING;
+
+            // Build request data
+            if (action == Action::ARM_HOME) {
+                // Arm home partitions request
+                data[0] = armed_home->value() & partsList;
+            } else if (action == Action::ARM_AWAY) {
+                // Arm away partitions request
+                data[0] = armed_away->value() & partsList;
+            } else if (action == Action::ARM_NIGHT) {
+                // Arm night partitions request
+                data[0] = armed_night->value() & partsList;
+            } else if (action == Action::DISARM) {
+                // Disarm partitions request
+                data[3] = partsList;
+                requested = AlarmStatus::PENDING;
+            } else {
+                return;
+            }
 
-                if (model == KYO_MODEL_4) alarmModel = AlarmModel::KYO_4;
-                else if (model == KYO_MODEL_8) alarmModel = AlarmModel::KYO_8;
-                else if (model == KYO_MODEL_8G) alarmModel = AlarmModel::KYO_8G;
-                else if (model == KYO_MODEL_32) alarmModel = AlarmModel::KYO_32;
-                else if (model == KYO_MODEL_32G) alarmModel = AlarmModel::KYO_32G;
-                else if (model == KYO_MODEL_8W) alarmModel = AlarmModel::KYO_8W;
-                else if (model == KYO_MODEL_8GW) alarmModel = AlarmModel::KYO_8GW;
-                else alarmModel = AlarmModel::UNKNOWN;
+            // Optimistic arming/pending state is published only once the request is queued
+            if (sendRequest(kyo_protocol::CMD_CTRL_PARTITIONS, &KyoAlarm::onCommandReply, data, Priority::COMMAND) == false) {
+                ESP_LOGE(LOG_TAG, "Process command request dropped");
+                return;
+            }
+
+            confirmPrevious = alarmStatus;
+            confirmArmed = data[0];
+            confirmDisarmed = data[3];
+            publishAlarmStatus(requested);
+        }
+
+        void onCommandReply(bool success, const uint8_t *reply, size_t size) {
+            if (success) {
+                sendClose();
+
+                // Read status back until the alarm confirms the command
+                confirmPending = true;
+                confirmStart = millis();
+                scheduler.run(POLL_STATUS, millis());
+                sendRead(readPlans[POLL_STATUS], Priority::COMMAND);
+            } else {
+                ESP_LOGE(LOG_TAG, "Process command request failed");
+                publishAlarmStatus(confirmPrevious);
+            }
+        }
+
+        // Returns true while the command is not confirmed and the deadline is not expired
+        bool checkCommandConfirm() {
+            const kyo_protocol::Status &status = partitionsStatus;
+            uint8_t armed = status.armedAway | status.armedStay | status.armedStay0;
+
+            if (confirmPending == false) {
+                return (false);
+            }
+
+            if (((armed & confirmArmed) == confirmArmed) && ((status.disarmed & confirmDisarmed) == confirmDisarmed)) {
+                ESP_LOGD(LOG_TAG, "Command confirmed in %u ms", static_cast<unsigned>(millis() - confirmStart));
+                confirmPending = false;
+                return (false);
+            }
+
+            if ((millis() - confirmStart) >= COMMAND_CONFIRM_TIMEOUT_MS) {
+                ESP_LOGE(LOG_TAG, "Command not confirmed by the alarm");
+                confirmPending = false;
+                confirmFailed = true;
+                return (false);
+            }
+
+            return (true);
+        }
+
+        static const char *getAlarmStatusName(AlarmStatus status) {
+            static const char *const names[] = {"unavailable", "pending", "arming", "armed_away", "armed_home", "armed_night", "disarmed", "triggered"};
+
+            return (names[static_cast<int>(status)]);
+        }
 
-                ESP_LOGCONFIG(LOG_TAG, "KYO model request completed [%s %s]", model.c_str(), firmware.c_str());
-                return (true);
+        // Every alarm status change goes through here, stable states are also saved to flash
+        void publishAlarmStatus(AlarmStatus status) {
+            alarmStatusSensor->publish_state(getAlarmStatusName(status));
+            alarmStatus = status;
+            saveAlarmStatus();
+        }
+
+        void onBypassZoneReply(bool success, const uint8_t *reply, size_t size) {
+            if (success) {
+                sendClose();
+            } else {
+                ESP_LOGE(LOG_TAG, "Bypass zone request failed");
+            }
+        }
+
+        void onClockReply(bool success, const uint8_t *reply, size_t size) {
+            uint8_t data[kyo_protocol::CLOCK_SIZE];
+            uint32_t reference = clockReference + (millis() - clockReferenceAt) / 1000;
+            int32_t drift = 0;
+
+            if ((success == false) || (kyo_protocol::getClockDrift(reply, size, reference, drift) == false)) {
+                ESP_LOGE(LOG_TAG, "Clock request failed");
+                return;
             }
 
-            ESP_LOGE(LOG_TAG, "KYO model request failed");
-            return (false);
+            clockDriftSensor->publish_state(drift);
+
+            if (kyo_protocol::isClockOff(drift, clockThreshold) == true) {
+                ESP_LOGI(LOG_TAG, "Panel clock off by %d s, setting it", static_cast<int>(drift));
+                kyo_protocol::encodeClock(reference, data);
+                sendRequest(kyo_protocol::CMD_SET_TIME, &KyoAlarm::onTimeSyncReply, data);
+            }
         }
 
-        bool getPartitionsList() {
-            std::vector<uint8_t> request = cmdGetPartitionsList;
-            std::vector<uint8_t> reply;
+        void onTimeSyncReply(bool success, const uint8_t *reply, size_t size) {
+            if (success) {
+                sendClose();
+            } else {
+                ESP_LOGE(LOG_TAG, "Set time request failed");
+            }
+        }
 
-            appendChecksum(request);
+        void onDiscoveryRead(bool success) {
+            kyo_protocol::AlarmInfo info;
 
-            if (sendRequest(request, reply, 100) && reply.size() == RPL_GET_PARTITIONS_LIST_SIZE) {
-                // Parse reply
-                partsList = reply[1];
+            if (success == false) {
+                ESP_LOGE(LOG_TAG, "KYO model request failed");
+                return;
+            }
+
+            if (memory.isDirty(kyo_protocol::REGION_ALARM_INFO)) {
+                if (kyo_protocol::decodeAlarmInfo(memory.getData(kyo_protocol::REGION_ALARM_INFO), memory.getSize(kyo_protocol::REGION_ALARM_INFO), info)) {
+                    modelSensor->publish_state(info.model);
+                    firmwareSensor->publish_state(info.firmware);
+
+                    alarmModel = info.alarmModel;
+
+                    if (kyo_protocol::getModelZones(alarmModel) > ZONES) {
+                        ESP_LOGW(LOG_TAG, "Only %u of %u zones handled, set KYO_PANEL to the alarm model", static_cast<unsigned>(ZONES),
+                                 static_cast<unsigned>(kyo_protocol::getModelZones(alarmModel)));
+                    }
+
+                    ESP_LOGCONFIG(LOG_TAG, "KYO model request completed [%s %s]", info.model, info.firmware);
+                }
+
+                memory.clearDirty(kyo_protocol::REGION_ALARM_INFO);
+            }
+
+            updatePartitionsList();
+
+            discoveryVerified = true;
+            saveCache();
+        }
+
+        void updatePartitionsList() {
+            if (memory.isDirty(kyo_protocol::REGION_PARTITIONS) == false) {
+                return;
+            }
+
+            if (kyo_protocol::decodePartitionsList(memory.getData(kyo_protocol::REGION_PARTITIONS), memory.getSize(kyo_protocol::REGION_PARTITIONS), partsList)) {
+                partsList &= Caps::PARTITIONS_MASK;
 
                 ESP_LOGCONFIG(LOG_TAG, "Partitions list request completed [" BYTE_TO_BINARY_PATTERN "]", BYTE_TO_BINARY(partsList));
                 ESP_LOGCONFIG(LOG_TAG, "Arm home partitions [" BYTE_TO_BINARY_PATTERN "]", BYTE_TO_BINARY(armed_home->value() & partsList));
                 ESP_LOGCONFIG(LOG_TAG, "Arm away partitions [" BYTE_TO_BINARY_PATTERN "]", BYTE_TO_BINARY(armed_away->value() & partsList));
                 ESP_LOGCONFIG(LOG_TAG, "Arm night partitions [" BYTE_TO_BINARY_PATTERN "]", BYTE_TO_BINARY(armed_night->value() & partsList));
-                return (true);
             }
 
-            ESP_LOGE(LOG_TAG, "Partitions list request failed");
-            return (false);
+            memory.clearDirty(kyo_protocol::REGION_PARTITIONS);
         }
 
-        bool getRealTimeStatus () {
-            std::vector<uint8_t> request = cmdGetRealTimeStatus;
-            std::vector<uint8_t> reply;
+        void onRealTimeStatusRead(bool success) {
+            const kyo_protocol::RegionId region = kyo_protocol::REGION_REAL_TIME_STATUS;
+            kyo_protocol::RealTimeStatus &status = realTimeStatus;
 
-            appendChecksum(request);
+            if (success == false) {
+                ESP_LOGE(LOG_TAG, "Real-time status request failed");
+                return;
+            }
 
-            if (sendRequest(request, reply, 1000) && reply.size() == RPL_GET_REAL_TIME_STATUS_SIZE) {
-                uint32_t info = 0;
+            // Decode and publish only fields changed since last read
+            if (memory.isDirty(region) && kyo_protocol::decodeRealTimeStatus(memory.getData(region), memory.getSize(region), status)) {
+                uint32_t changed = 0;
 
-                // Parse zones alarm status
-                info = (reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3];
-                for (int i = 0; i < KYO_MAX_ZONES; i++) {
-                    zoneSensor[i].publish_state((info >> i) & 0x01);
-                }
+                // Ignore zones not handled
+                status.zones &= Caps::ZONES_MASK;
+                status.tampers &= Caps::ZONES_MASK;
 
-                // Parse zones tamper status
-                info = (reply[4] << 24) | (reply[5] << 16) | (reply[6] << 8) | reply[7];
-                for (int i = 0; i < KYO_MAX_ZONES; i++) {
-                    zTamperSensor[i].publish_state((info >> i) & 0x01);
-                }
+                // Publish zones alarm status changes
+                if (memory.isDirty(region, kyo_protocol::RT_ZONES, 4)) {
+                    bool known = zonesAlarm.isValid();
 
-                // Parse partitions alarm status
-                if (reply[9] > 0) {
-                    // At least one partition in alarm status
-                    if (alarmStatus != AlarmStatus::TRIGGERED) {
-                        alarmStatusSensor->publish_state("triggered");
-                        alarmStatus = AlarmStatus::TRIGGERED;
+                    changed = zonesAlarm.update(status.zones);
+                    if (changed != 0) {
+                        lastActivity = millis();
                     }
-                } else {
-                    // Alarm status reset, next getStatus() call will set proper alarm status
-                    if (alarmStatus == AlarmStatus::TRIGGERED) {
-                        alarmStatusSensor->publish_state("pending");
-                        alarmStatus = AlarmStatus::PENDING;
+
+                    if (known == true) {
+                        journalMask(kyo_protocol::EVENT_ZONE, changed, status.zones);
+                    }
+
+                    zonesPending[PUBLISH_ZONE] |= changed;
+                }
+
+                // Publish zones tamper status changes
+                if (memory.isDirty(region, kyo_protocol::RT_TAMPERS, 4)) {
+                    bool known = zonesTamper.isValid();
+
+                    changed = zonesTamper.update(status.tampers);
+                    if (known == true) {
+                        journalMask(kyo_protocol::EVENT_TAMPER, changed, status.tampers);
                     }
+
+                    zonesPending[PUBLISH_TAMPER] |= changed;
+                }
+
+                // Publish warnings and tampers changes
+                if (warningFlags.update(status.warnings) != 0) {
+                    warningSensor->publish_state(status.warnings);
+                }
+
+                bool known = tamperFlags.isValid();
+
+                changed = tamperFlags.update(status.tamperFlags);
+                if (changed != 0) {
+                    tamperSensor->publish_state(status.tamperFlags);
+                }
+
+                // PINs may be changed while the panel is open for programming, the first flags after boot or rediscovery are not a change
+                if ((known == true) && ((changed & kyo_protocol::TAMPER_SYSTEM) != 0)) {
+                    pinTable.invalidate();
                 }
 
-                // Parse warnings and tampers
-                warningSensor->publish_state(reply[8]);
-                tamperSensor->publish_state(reply[10]);
-                return (true);
+                publishPackedState();
             }
 
-            ESP_LOGE(LOG_TAG, "Real-time status request failed");
-            return (false);
+            memory.clearDirty(region);
+
+            // Parse partitions alarm status
+            if (status.alarms > 0) {
+                // At least one partition in alarm status
+                if (alarmStatus != AlarmStatus::TRIGGERED) {
+                    publishAlarmStatus(AlarmStatus::TRIGGERED);
+                    if (lastRealTimeValid == true) {
+                        triggerDelayBoundSensor->publish_state(millis() - lastRealTimeRead);
+                    }
+
+                    // Read alarm memory right away to tell which zones caused it
+                    scheduler.run(POLL_STATUS, millis());
+                    sendRead(readPlans[POLL_STATUS], Priority::ALARM);
+                }
+            } else {
+                // Alarm status reset, next status read will set proper alarm status
+                if (alarmStatus == AlarmStatus::TRIGGERED) {
+                    publishAlarmStatus(AlarmStatus::PENDING);
+                }
+            }
+
+            lastRealTimeRead = getLinkStart();
+            lastRealTimeValid = true;
         }
 
-        bool getStatus () {
-            std::vector<uint8_t> request = cmdGetStatus;
-            std::vector<uint8_t> reply;
+        void onStatusRead(bool success) {
+            const kyo_protocol::RegionId region = kyo_protocol::REGION_STATUS;
+            kyo_protocol::Status &status = partitionsStatus;
+            uint8_t armed = 0;
+            uint8_t disarmed = 0;
 
-            appendChecksum(request);
+            if (success == false) {
+                ESP_LOGE(LOG_TAG, "Status request failed");
+                return;
+            }
 
-            if (sendRequest(request, reply, 1000) && reply.size() == RPL_GET_STATUS_SIZE) {
-                uint8_t armed = 0;
-                uint8_t disarmed = 0;
-                uint32_t info = 0;
+            // Decode only if changed since last read
+            if (memory.isDirty(region) && kyo_protocol::decodeStatus(memory.getData(region), memory.getSize(region), status)) {
+                uint32_t changed = 0;
 
-                if (alarmStatus != AlarmStatus::TRIGGERED) {
-                    // Parse armed partitions (away, stay and stay 0 delay modes are all armed)
-                    armed = (reply[0] | reply[1] | reply[2]) & partsList;
-
-                    // Parse disarmed partitions
-                    disarmed = reply[3] & partsList;
-
-                    // Publish alarm status
-                    if ((disarmed == partsList) && (alarmStatus != AlarmStatus::DISARMED)) {
-                        // All partitions are disarmed
-                        alarmStatusSensor->publish_state("disarmed");
-                        alarmStatus = AlarmStatus::DISARMED;
-                    } else if ((armed == (armed_home->value() & partsList)) && (alarmStatus != AlarmStatus::ARMED_HOME)) {
-                        // All partitions are armed home
-                        alarmStatusSensor->publish_state("armed_home");
-                        alarmStatus = AlarmStatus::ARMED_HOME;
-                    } else if ((armed == (armed_away->value() & partsList)) && (alarmStatus != AlarmStatus::ARMED_AWAY)) {
-                        // All partitions are armed away
-                        alarmStatusSensor->publish_state("armed_away");
-                        alarmStatus = AlarmStatus::ARMED_AWAY;
-                    } else if ((armed == (armed_night->value() & partsList)) && (alarmStatus != AlarmStatus::ARMED_NIGHT)) {
-                        // All partitions are armed night
-                        alarmStatusSensor->publish_state("armed_night");
-                        alarmStatus = AlarmStatus::ARMED_NIGHT;
+                // Ignore zones not handled
+                status.bypassed &= Caps::ZONES_MASK;
+                status.alarmMemory &= Caps::ZONES_MASK;
+                status.tamperMemory &= Caps::ZONES_MASK;
+
+                // Publish bypassed zones changes
+                if (memory.isDirty(region, kyo_protocol::ST_BYPASSED, 4)) {
+                    bool known = zonesBypass.isValid();
+
+                    changed = zonesBypass.update(status.bypassed);
+                    if (known == true) {
+                        journalMask(kyo_protocol::EVENT_BYPASS, changed, status.bypassed);
                     }
+
+                    zonesPending[PUBLISH_BYPASS] |= changed;
                 }
 
-                // Parse bypassed zones
-                info = (reply[7] << 24) | (reply[8] << 16) | (reply[9] << 8) | reply[10];
-                for (int i = 0; i < KYO_MAX_ZONES; i++) {
-                    zoneSwitches[i]->publish_state((info >> i) & 0x01);
+                // Publish zones alarm memory changes
+                if (memory.isDirty(region, kyo_protocol::ST_ALARM_MEMORY, 4)) {
+                    zonesPending[PUBLISH_ALARM_MEMORY] |= zonesAlarmMemory.update(status.alarmMemory);
                 }
 
-                // TODO: Publish also:
-                //       - Outputs status
-                //       - Alarm memory zones
-                //       - Tamper memory zones
+                // Publish zones tamper memory changes
+                if (memory.isDirty(region, kyo_protocol::ST_TAMPER_MEMORY, 4)) {
+                    zonesPending[PUBLISH_TAMPER_MEMORY] |= zonesTamperMemory.update(status.tamperMemory);
+                }
+
+                // Publish outputs changes
+                if (outputFlags.update(status.outputs) != 0) {
+                    outputsSensor->publish_state(status.outputs);
+                }
+
+                publishPackedState();
+            }
+
+            memory.clearDirty(region);
+
+            // Alarm status is not published while waiting for a command to be confirmed
+            if (checkCommandConfirm() == true) {
+                return;
+            }
+
+            // Alarm status is checked on every read, a command may have changed it
+            if (alarmStatus != AlarmStatus::TRIGGERED) {
+                // Parse armed partitions (away, stay and stay 0 delay modes are all armed)
+                armed = (status.armedAway | status.armedStay | status.armedStay0) & partsList;
+
+                // Parse disarmed partitions
+                disarmed = status.disarmed & partsList;
+
+                // Publish alarm status
+                if ((disarmed == partsList) && (alarmStatus != AlarmStatus::DISARMED)) {
+                    // All partitions are disarmed
+                    publishAlarmStatus(AlarmStatus::DISARMED);
+                } else if ((armed == (armed_home->value() & partsList)) && (alarmStatus != AlarmStatus::ARMED_HOME)) {
+                    // All partitions are armed home
+                    publishAlarmStatus(AlarmStatus::ARMED_HOME);
+                } else if ((armed == (armed_away->value() & partsList)) && (alarmStatus != AlarmStatus::ARMED_AWAY)) {
+                    // All partitions are armed away
+                    publishAlarmStatus(AlarmStatus::ARMED_AWAY);
+                } else if ((armed == (armed_night->value() & partsList)) && (alarmStatus != AlarmStatus::ARMED_NIGHT)) {
+                    // All partitions are armed night
+                    publishAlarmStatus(AlarmStatus::ARMED_NIGHT);
+                }
+            }
 
-                return (true);
+            // Command failed and partitions match no alarm status
+            if ((confirmFailed == true) && ((alarmStatus == AlarmStatus::ARMING) || (alarmStatus == AlarmStatus::PENDING))) {
+                publishAlarmStatus(confirmPrevious);
             }
 
-            ESP_LOGE(LOG_TAG, "Status request failed");
-            return (false);
+            confirmFailed = false;
         }
 
-        bool getPinsList() {
-            std::vector<uint8_t> request1 = cmdGetPinsList1;
-            std::vector<uint8_t> request2 = cmdGetPinsList2;
-            std::vector<uint8_t> reply1;
-            std::vector<uint8_t> reply2;
+        void onPinsListRead(bool success) {
+            const kyo_protocol::RegionId region = kyo_protocol::REGION_PINS;
 
-            appendChecksum(request1);
-            appendChecksum(request2);
+            if (success == false) {
+                ESP_LOGE(LOG_TAG, "PINs list request failed");
+                onPinsListCompleted(false);
+                return;
+            }
 
-            if (sendRequest(request1, reply1, 500) && reply1.size() == RPL_GET_PINS_LIST_1_SIZE) {
-                if (sendRequest(request2, reply2, 500) && reply2.size() == RPL_GET_PINS_LIST_2_SIZE) {
-                    memcpy(pinsList, reply1.data(), RPL_GET_PINS_LIST_1_SIZE - 1);
-                    memcpy(&pinsList[RPL_GET_PINS_LIST_1_SIZE - 1], reply2.data(), RPL_GET_PINS_LIST_2_SIZE - 1);
+            if (memory.isDirty(region) || (pinTable.isValid() == false)) {
+                pinTable.load(memory.getData(region), memory.getSize(region));
+                memory.clearDirty(region);
+                ESP_LOGD(LOG_TAG, "PINs list loaded [%u PINs]", static_cast<unsigned>(pinTable.getSize()));
+            }
 
-                    return (true);
-                }
+            pinsVerified = true;
+
+            // Partitions list is read along with PINs
+            updatePartitionsList();
+            saveCache();
+
+            onPinsListCompleted(true);
+        }
+
+        void restoreCache() {
+            // Both preferences are created before any return, so they are saved even after a cache miss
+            cachePref = global_preferences->make_preference<PanelCache>(fnv1_hash("kyo_panel_cache"), true);
+            statusPref = global_preferences->make_preference<uint8_t>(fnv1_hash("kyo_alarm_status"), true);
+
+            if (cachePref.load(&cache) == false) {
+                return;
             }
 
-            ESP_LOGE(LOG_TAG, "PINs list request failed");
-            return (false);
+            memory.store(kyo_protocol::REGION_MAP[kyo_protocol::REGION_ALARM_INFO].addr, cache.alarmInfo, sizeof(cache.alarmInfo));
+            memory.store(kyo_protocol::REGION_MAP[kyo_protocol::REGION_PARTITIONS].addr, cache.partitions, sizeof(cache.partitions));
+            memory.store(kyo_protocol::REGION_MAP[kyo_protocol::REGION_PINS].addr, cache.pins, sizeof(cache.pins));
+
+            ESP_LOGCONFIG(LOG_TAG, "Restoring cached panel identity and PINs");
+            onDiscoveryRead(true);
+            onPinsListRead(true);
+
+            // Cached data is used until the panel confirms it
+            discoveryVerified = false;
+            pinsVerified = false;
+
+            if ((statusPref.load(&cachedStatus) == true) && isStableStatus(static_cast<AlarmStatus>(cachedStatus)) && isDiscovered()) {
+                ESP_LOGCONFIG(LOG_TAG, "Restoring cached alarm status [%s]", getAlarmStatusName(static_cast<AlarmStatus>(cachedStatus)));
+                publishAlarmStatus(static_cast<AlarmStatus>(cachedStatus));
+            }
         }
 
-        bool verifyPin(std::string pin) {
-            uint32_t pinCode = 0;
+        // Save alarm status to flash, only if stable and changed
+        void saveAlarmStatus() {
+            if (isStableStatus(alarmStatus) && (static_cast<uint8_t>(alarmStatus) != cachedStatus)) {
+                cachedStatus = static_cast<uint8_t>(alarmStatus);
+                statusPref.save(&cachedStatus);
+            }
+        }
 
-            // Check PIN size (4 - 6 digits)
-            if ((pin.length() > 3) && (pin.length() < 7) && (std::all_of(pin.begin(), pin.end(), ::isdigit))) {
-                // Pad PIN to 6 digits with 'f'
-                pin.insert(pin.end(), 6 - pin.length(), 'f');
+        static bool isStableStatus(AlarmStatus status) {
+            return ((status == AlarmStatus::ARMED_AWAY) || (status == AlarmStatus::ARMED_HOME) || (status == AlarmStatus::ARMED_NIGHT) ||
+                    (status == AlarmStatus::DISARMED));
+        }
 
-                // Encode PIN as unsigned 32 bit integer
-                for (char c: pin) {
-                    pinCode <<= 4;
-                    pinCode |= (c == 'f') ? 0xf : c - 0x30;
-                }
+        // Save cached regions to flash, only if changed
+        void saveCache() {
+            PanelCache current;
+
+            if (isDiscovered() == false) {
+                return;
+            }
+
+            memcpy(current.alarmInfo, memory.getData(kyo_protocol::REGION_ALARM_INFO), sizeof(current.alarmInfo));
+            memcpy(current.partitions, memory.getData(kyo_protocol::REGION_PARTITIONS), sizeof(current.partitions));
+            memcpy(current.pins, memory.getData(kyo_protocol::REGION_PINS), sizeof(current.pins));
+
+            if ((pinTable.isValid() == true) && (memcmp(&current, &cache, sizeof(PanelCache)) != 0)) {
+                cache = current;
+                cachePref.save(&cache);
+            }
+        }
 
-                // Read PIN list from alarm
-                if (getPinsList() == true) {
-                    for (int i = 0; i < KYO_STORED_PINS * 3; i += 3) {
-                        uint32_t pinRef = 0;
+        void planReads(int id, uint32_t regions, ReadHandler handler) {
+            readPlans[id].count = kyo_protocol::planReads(regions, readPlans[id].frames, READ_PLAN_FRAMES);
+            readPlans[id].handler = handler;
+        }
+
+        bool sendRead(const ReadPlan &plan, Priority priority, size_t frame = 0) {
+            Transaction transaction;
+
+            kyo_protocol::encode(plan.frames[frame], transaction.request);
+            transaction.command = &plan.frames[frame];
+            transaction.handler = &KyoAlarm::onReadReply;
+            transaction.priority = priority;
+            transaction.plan = &plan;
+            transaction.frame = frame;
+
+            return (isLinkUp() && enqueue(transaction));
+        }
+
+        void onReadReply(bool success, const uint8_t *reply, size_t size) {
+            const ReadPlan *plan = txCurrent.plan;
+            size_t frame = txCurrent.frame + 1;
 
-                        // Encode reference PIN as unsigned 32 bit integer
-                        pinRef |= (pinsList[i] << 16) & 0x00FF0000;
-                        pinRef |= (pinsList[i + 1] << 8) & 0x0000FF00;
-                        pinRef |=  pinsList[i + 2] & 0x000000FF;
+            if (success) {
+                // Store data, without checksum
+                memory.store(txCurrent.command->addr, reply, size - 1);
 
-                        if (pinCode == pinRef) {
-                            return (true);
-                        }
+                // Queue next frame with the same priority
+                if (frame < plan->count) {
+                    if (sendRead(*plan, txCurrent.priority, frame) == true) {
+                        return;
                     }
+
+                    success = false;
                 }
+            }
 
-                ESP_LOGW(LOG_TAG, "Unknown PIN provided.");
+            (this->*plan->handler)(success);
+        }
+
+
+        bool sendRequest(const kyo_protocol::Command &command, ReplyHandler handler = nullptr, const uint8_t *data = nullptr, Priority priority = Priority::ROUTINE) {
+            Transaction transaction;
+
+            kyo_protocol::encode(command, transaction.request, data);
+            transaction.command = &command;
+            transaction.handler = handler;
+            transaction.priority = priority;
+            transaction.plan = nullptr;
+            transaction.frame = 0;
+
+            return (isLinkUp() && enqueue(transaction));
+        }
+
+        bool enqueue(const Transaction &transaction) {
+            if (txQueue.push(transaction, millis()) == false) {
+                ESP_LOGW(LOG_TAG, "Request queue full");
                 return (false);
             }
 
-            ESP_LOGE(LOG_TAG, "Invalid PIN provided.");
-            return (false);
+            return (true);
+        }
+
+        void sendClose() {
+            sendRequest(kyo_protocol::CMD_CLOSE, nullptr, nullptr, Priority::FOLLOW_UP);
         }
 
-        uint8_t getChecksum(const std::vector<uint8_t> &data, size_t offset = 0) {
-            uint8_t ckSum = 0;
+        void flushBypass() {
+            uint8_t data[kyo_protocol::getDataSize(kyo_protocol::CMD_ZONE_BYPASS)] = {0};
 
-            for (int i = offset; i < data.size(); i++) {
-                ckSum += data[i];
+            // Write pending changes once they settle and no other command is waiting
+            if (((bypassInclude | bypassExclude) == 0) || ((millis() - bypassChanged) < BYPASS_HOLD_MS) ||
+                (isLinkIdle() == false) || (txQueue.isEmpty() == false)) {
+                return;
             }
 
-            return (ckSum);
+            // Include mask in bytes 0 - 3, exclude mask in bytes 4 - 7 (MSB first)
+            for (int i = 0; i < 4; i++) {
+                data[i] = (bypassInclude >> (24 - 8 * i)) & 0xff;
+                data[i + 4] = (bypassExclude >> (24 - 8 * i)) & 0xff;
+            }
+
+            if (sendRequest(kyo_protocol::CMD_ZONE_BYPASS, &KyoAlarm::onBypassZoneReply, data, Priority::COMMAND) == true) {
+                bypassInclude = 0;
+                bypassExclude = 0;
+            }
         }
 
-        void appendChecksum(std::vector<uint8_t> &data, size_t offset = 0) {
-            data.push_back(getChecksum(const_cast<std::vector<uint8_t>&>(data), offset));
+        void processLink() {
+            if (isLinkIdle() == true) {
+                if (txQueue.pop(txCurrent, millis()) == true) {
+                    ESP_LOGD(LOG_TAG, "Request: %s", format_hex_pretty(txCurrent.request.data, txCurrent.request.size).c_str());
+                    startLink();
+                }
+                return;
+            }
+
+            switch (processLinkEvent()) {
+                case SerialLink::Event::NONE:
+                    break;
+
+                case SerialLink::Event::COMPLETE:
+                    if (getLinkParser().getReplySize() > 0) {
+                        ESP_LOGD(LOG_TAG, "Reply: %s", format_hex_pretty(getLinkParser().getReply(), getLinkParser().getReplySize()).c_str());
+                    }
+
+                    if (getLinkParser().isValid() == false) {
+                        ESP_LOGW(LOG_TAG, "Reply checksum error");
+                    }
+
+                    completeRequest(getLinkParser().isValid());
+                    break;
+
+                case SerialLink::Event::TIMEOUT:
+                    if (isEchoTimeout() == true) {
+                        ESP_LOGD(LOG_TAG, "Request echo timeout");
+                    } else {
+                        ESP_LOGD(LOG_TAG, "Reply timeout [%u/%u bytes]", static_cast<unsigned>(getLinkParser().getReplySize()), static_cast<unsigned>(kyo_protocol::getReplySize(*txCurrent.command)));
+                    }
+
+                    completeRequest(false);
+                    break;
+            }
+        }
+
+        /*
+         * Link access
+         * On ESP32 the link runs on its own task (see kyo_protocol::LinkWorker):
+         * requests are submitted to the worker, parser, timing and statistics
+         * are those of the last exchange handed back. Elsewhere the link is
+         * run by loop() itself.
+         */
+#ifdef USE_ESP32
+        static void runLinkTask(void *arg) {
+            KyoAlarm *alarm = static_cast<KyoAlarm *>(arg);
+
+            for (;;) {
+                alarm->linkWorker.service(millis());
+                vTaskDelay(1);
+            }
+        }
+
+        bool isLinkIdle() const {
+            return (linkBusy == false);
+        }
+
+        void startLink() {
+            linkBusy = true;
+            linkSubmitted = linkWorker.submit(txCurrent.request, *txCurrent.command);
+
+            if (linkSubmitted == false) {
+                ESP_LOGW(LOG_TAG, "Link task busy, request held");
+            }
+        }
+
+        SerialLink::Event processLinkEvent() {
+            // Jobs ring full, the current request is kept and submitted again until the worker takes it
+            if (linkSubmitted == false) {
+                linkSubmitted = linkWorker.submit(txCurrent.request, *txCurrent.command);
+                return (SerialLink::Event::NONE);
+            }
+
+            if (linkWorker.poll(linkResult) == false) {
+                return (SerialLink::Event::NONE);
+            }
+
+            linkBusy = false;
+            return (linkResult.timeout ? SerialLink::Event::TIMEOUT : SerialLink::Event::COMPLETE);
+        }
+
+        const kyo_protocol::FrameParser &getLinkParser() const {
+            return (linkResult.parser);
+        }
+
+        bool isEchoTimeout() const {
+            return (linkResult.echoTimeout);
+        }
+
+        uint32_t getLinkStart() const {
+            return (linkResult.start);
+        }
+
+        const kyo_protocol::LinkStats &getLinkStats() const {
+            return (linkResult.stats);
+        }
+#else
+        bool isLinkIdle() const {
+            return (link.isIdle());
+        }
+
+        void startLink() {
+            link.start(txCurrent.request, *txCurrent.command, millis());
+        }
+
+        SerialLink::Event processLinkEvent() {
+            return (link.process(millis()));
+        }
+
+        const kyo_protocol::FrameParser &getLinkParser() const {
+            return (link.getParser());
+        }
+
+        bool isEchoTimeout() const {
+            return (link.getWaitState() == SerialLink::State::WAIT_ECHO);
+        }
+
+        uint32_t getLinkStart() const {
+            return (link.getStart());
+        }
+
+        const kyo_protocol::LinkStats &getLinkStats() const {
+            return (link.getStats());
         }
+#endif
 
-        bool verifyChecksum(const std::vector<uint8_t> &data, size_t offset = 0) {
-            uint8_t ckSum = 0;
+        void completeRequest(bool success) {
+            linkBusyTime += millis() - getLinkStart();
 
-            for (int i = offset; i < data.size() - 1; i++) {
-                ckSum += data[i];
+            if (capture != nullptr) {
+                capture->buffer.push(capture->record);
             }
 
-            return (data.back() == ckSum);
+            if (txCurrent.handler != nullptr) {
+                uint32_t start = micros();
+
+                (this->*txCurrent.handler)(success, getLinkParser().getReply(), getLinkParser().getReplySize());
+                handlerStats.record(kyo_protocol::getStatId(*txCurrent.command), micros() - start);
+            }
+
+            updateLinkHealth(success);
         }
 
-        static inline void rtrim(std::string &str) {
-            str.erase(std::find_if(str.rbegin(), str.rend(), [](unsigned char ch) {
-                return !std::isspace(ch);
-            }).base(), str.end());
+        void updateLinkHealth(bool success) {
+            kyo_protocol::HealthMonitor::Event event = linkHealth.update(success, millis());
+
+            if (event == kyo_protocol::HealthMonitor::Event::NONE) {
+                return;
+            }
+
+            if (event == kyo_protocol::HealthMonitor::Event::RESTORED) {
+                ESP_LOGW(LOG_TAG, "Link restored");
+                rediscover();
+            } else if (event == kyo_protocol::HealthMonitor::Event::DOWN) {
+                ESP_LOGE(LOG_TAG, "Link down, alarm not answering");
+
+                // Drop queued requests and pending changes, they would fail anyway
+                txQueue.clear();
+                pendingAction = Action::NONE;
+                confirmPending = false;
+                bypassInclude = 0;
+                bypassExclude = 0;
+
+                publishAlarmStatus(AlarmStatus::UNAVAILABLE);
+            }
+
+            linkStatusSensor->publish_state(kyo_protocol::HealthMonitor::getName(linkHealth.getHealth()));
         }
 
-        bool sendRequest(std::vector<uint8_t> request, std::vector<uint8_t> &reply, uint wait = 0) {
-            ESP_LOGD(LOG_TAG, "Request: %s", format_hex_pretty(request).c_str());
+        // Forget everything known about the alarm, discovery and all reads start over
+        void rediscover() {
+            alarmModel = AlarmModel::UNKNOWN;
+            partsList = 0;
+            discoveryVerified = false;
+            pinsVerified = false;
 
-            // Empty receiveing buffer
-            while (available() > 0) {
-                read();
+            for (int id = 0; id < kyo_protocol::REGIONS; id++) {
+                memory.invalidate(static_cast<kyo_protocol::RegionId>(id));
             }
 
-            // Send request
-            write_array(reinterpret_cast<byte*> (request.data()), request.size());
+            zonesAlarm.invalidate();
+            zonesTamper.invalidate();
+            zonesBypass.invalidate();
+            zonesAlarmMemory.invalidate();
+            zonesTamperMemory.invalidate();
+            warningFlags.invalidate();
+            tamperFlags.invalidate();
+            outputFlags.invalidate();
+            pinTable.invalidate();
+            packedStateText[0] = '\0';
+            pendingAction = Action::NONE;
+            lastRealTimeValid = false;
+
+            scheduler.reset(millis());
+        }
+
+        void sendProbe() {
+            Transaction transaction;
+
+            kyo_protocol::encode(kyo_protocol::CMD_PROBE, transaction.request);
+            transaction.command = &kyo_protocol::CMD_PROBE;
+            transaction.handler = nullptr;
+            transaction.priority = Priority::ROUTINE;
+            transaction.plan = nullptr;
+            transaction.frame = 0;
+
+            enqueue(transaction);
+        }
+
+        bool isLinkUp() const {
+            if (linkHealth.isDown() == true) {
+                ESP_LOGW(LOG_TAG, "Link down, request dropped");
+                return (false);
+            }
+
+            return (true);
+        }
+
+        bool isDiscovered() const {
+            return ((alarmModel != AlarmModel::UNKNOWN) && (partsList != 0));
+        }
+
+        // Armed, arming or triggered
+        bool isArmed() const {
+            return ((alarmStatus != AlarmStatus::DISARMED) && (alarmStatus != AlarmStatus::UNAVAILABLE));
+        }
 
-            delay(wait);
+        bool isPollEnabled(int id) const {
+            return ((id == POLL_DISCOVERY) ? !(isDiscovered() && discoveryVerified) : isDiscovered());
+        }
 
-            // Read reply
-            reply.clear();
+        bool isPollIdle(int id) const {
+            return (((id == POLL_PINS) && pinsVerified) || ((id == POLL_DISCOVERY) && isDiscovered()));
+        }
 
-            // Wait for request echo
-            if (available() >= 6) {
-                while (available() > 0) {
-                    reply.push_back(read());
+        uint32_t getPollInterval(int id) const {
+            if (id == POLL_REAL_TIME_STATUS) {
+                // Poll real-time status fast when armed or zones are changing
+                if (isArmed() || ((millis() - lastActivity) < activityHold)) {
+                    return (std::min(realTimeFastInterval, scheduler.getInterval(id)));
                 }
+            }
+
+            if ((id == POLL_STATUS) && (confirmPending == true)) {
+                // Read status back fast until the command is confirmed
+                return (std::min(static_cast<uint32_t>(COMMAND_CONFIRM_INT_MS), scheduler.getInterval(id)));
+            }
 
-                // Strip request echo
-                reply.erase(reply.begin(), reply.begin() + 6);
+            if ((id == POLL_PINS) && ((pinTable.isValid() == false) || (pinsVerified == false))) {
+                // Reload invalidated or unverified PINs list as soon as possible
+                return (std::min(static_cast<uint32_t>(POLL_DISCOVERY_INT_MS), scheduler.getInterval(id)));
+            }
+
+            return (scheduler.getInterval(id));
+        }
 
-                if (reply.size() > 0) {
-                    ESP_LOGD(LOG_TAG, "Reply: %s", format_hex_pretty(reply).c_str());
+        void schedulePoll() {
+            uint32_t now = millis();
+            uint32_t intervals[POLL_TASKS];
+            uint32_t enabled = 0;
+            uint32_t idle = 0;
+            int next;
 
-                    // Verify checksum
-                    return (verifyChecksum(const_cast<std::vector<uint8_t>&>(reply)));
+            if (isLinkIdle() == false) {
+                return;
+            }
+
+            // Poll only when queue is empty, but while armed real-time status
+            // cuts in ahead of queued requests (once between each of them)
+            if (txQueue.isEmpty() == false) {
+                if ((txCurrent.plan != &readPlans[POLL_REAL_TIME_STATUS]) && isFastPathDue(now)) {
+                    scheduler.run(POLL_REAL_TIME_STATUS, now);
+                    sendRead(readPlans[POLL_REAL_TIME_STATUS], Priority::ALARM);
                 }
+                return;
+            }
 
-                return (true);
+            // Only probe the alarm while the link is down
+            if (linkHealth.isDown() == true) {
+                if (linkHealth.isProbeDue(now) == true) {
+                    sendProbe();
+                }
+                return;
+            }
+
+            // Select the most overdue task, idle tasks only if nothing else is due
+            for (int i = 0; i < POLL_TASKS; i++) {
+                intervals[i] = getPollInterval(i);
+                enabled |= isPollEnabled(i) ? (1 << i) : 0;
+                idle |= isPollIdle(i) ? (1 << i) : 0;
             }
 
-            return (false);
+            if ((next = scheduler.select(now, enabled, idle, intervals)) < 0) {
+                return;
+            }
+
+            scheduler.run(next, now);
+
+            sendRead(readPlans[next], Priority::ROUTINE);
+        }
+
+        bool isFastPathDue(uint32_t now) const {
+            uint32_t interval = getPollInterval(POLL_REAL_TIME_STATUS);
+
+            return ((linkHealth.isDown() == false) && isArmed() && isPollEnabled(POLL_REAL_TIME_STATUS) &&
+                    (scheduler.getLateness(POLL_REAL_TIME_STATUS, now, interval) >= 0));
         }
 };
 
+// Panel capabilities (kyo_protocol::Kyo4, Kyo8 or Kyo32), set by YAML build flags
+#ifndef KYO_PANEL
+#define KYO_PANEL Kyo32
+#endif
+
+typedef KyoAlarm<kyo_protocol::KYO_PANEL> KyoAlarmComponent;
+
 class KyoZoneSwitch : public esphome::Component, public switch_::Switch {
     public:
         KyoZoneSwitch(int id) {
@@ -585,7 +1580,7 @@ class KyoZoneSwitch : public esphome::Component, public switch_::Switch {
         }
 
         void write_state(bool state) override {
-            if (zoneId < KYO_MAX_ZONES) {
+            if (zoneId < KyoAlarmComponent::ZONES) {
                 ((KyoAlarmComponent*) kyo)->bypassZone(zoneId, state);
             }
         }
@@ -0,0 +1,1965 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * KYO protocol core
+ * Framing, checksum and reply decoding shared by the ESPHome component.
+ * This file depends only on the C++ standard library, so it builds on any
+ * host and can be exercised without an ESP board or an alarm panel.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#define KYO_MODEL_4   "KYO4"
+#define KYO_MODEL_8   "KYO8"
+#define KYO_MODEL_8G  "KYO8G"
+#define KYO_MODEL_32  "KYO32"
+#define KYO_MODEL_32G "KYO32G"
+#define KYO_MODEL_8W  "KYO8 W"
+#define KYO_MODEL_8GW "KYO8G W"
+
+#define KYO_MAX_ZONES 32
+#define KYO_MAX_PARTITIONS 8
+
+#define KYO_STORED_PINS 24
+
+/* 
+ * Kyo Protocol
+ * ESP8266 and Kyo are little-endian
+ * Request format: <cmd><addr><len><data><cksum>
+ * uint8_t cmd: 0xf0 - read, 0x0f - write
+ * uint16_t addr
+ * uint16_t length - 2
+ * variable data
+ * uint8_t cksum % 0xff
+ */
+
+namespace kyo_protocol {
+
+enum class AlarmModel {UNKNOWN, KYO_4, KYO_8, KYO_8G, KYO_32, KYO_32G, KYO_8W, KYO_8GW};
+
+/*
+ * Panel capabilities
+ * Zones, partitions and PIN slots handled by the component, selected at
+ * compile time so that entity arrays, masks and loops are sized on the
+ * panel instead of the largest model.
+ */
+template<size_t Z, size_t P, size_t N>
+struct Capabilities {
+    static_assert((Z > 0) && (Z <= KYO_MAX_ZONES), "Unsupported zones count");
+    static_assert((P > 0) && (P <= KYO_MAX_PARTITIONS), "Unsupported partitions count");
+    static_assert((N > 0) && (N <= KYO_STORED_PINS), "Unsupported PINs count");
+
+    static constexpr size_t ZONES = Z;
+    static constexpr size_t PARTITIONS = P;
+    static constexpr size_t PINS = N;
+    static constexpr uint32_t ZONES_MASK = (Z < 32) ? ((static_cast<uint32_t>(1) << Z) - 1) : 0xffffffff;
+    static constexpr uint8_t PARTITIONS_MASK = (P < 8) ? ((1 << P) - 1) : 0xff;
+};
+
+typedef Capabilities<4, 4, KYO_STORED_PINS> Kyo4;
+typedef Capabilities<8, 4, KYO_STORED_PINS> Kyo8;
+typedef Capabilities<32, 8, KYO_STORED_PINS> Kyo32;
+
+// Zones of the detected model, 0 if unknown
+inline size_t getModelZones(AlarmModel model) {
+    switch (model) {
+        case AlarmModel::KYO_4:
+            return (Kyo4::ZONES);
+        case AlarmModel::KYO_8:
+        case AlarmModel::KYO_8G:
+        case AlarmModel::KYO_8W:
+        case AlarmModel::KYO_8GW:
+            return (Kyo8::ZONES);
+        case AlarmModel::KYO_32:
+        case AlarmModel::KYO_32G:
+            return (Kyo32::ZONES);
+        default:
+            return (0);
+    }
+}
+
+// Panel identification (alarm info reply)
+struct AlarmInfo {
+    char model[8];
+    char firmware[12];
+    AlarmModel alarmModel;
+};
+
+// Real-time status region
+struct RealTimeStatus {
+    uint32_t zones;         // Zones in alarm, bit 0 is zone 1
+    uint32_t tampers;       // Zones in tamper, bit 0 is zone 1
+    uint8_t warnings;       // Warning flags
+    uint8_t alarms;         // Partitions in alarm
+    uint8_t tamperFlags;    // Tamper flags
+};
+
+// System tamper flag, set while the panel enclosure is open (e.g. for programming)
+const uint8_t TAMPER_SYSTEM = 0x20;
+
+// Partitions status region
+struct Status {
+    uint8_t armedAway;      // Partitions armed away
+    uint8_t armedStay;      // Partitions armed stay
+    uint8_t armedStay0;     // Partitions armed stay with 0 delay
+    uint8_t disarmed;       // Partitions disarmed
+    uint8_t outputs;        // Outputs active, bit 0 is output 1
+    uint32_t bypassed;      // Bypassed zones, bit 0 is zone 1
+    uint32_t alarmMemory;   // Zones in alarm memory, bit 0 is zone 1
+    uint32_t tamperMemory;  // Zones in tamper memory, bit 0 is zone 1
+};
+
+/*
+ * Command descriptors
+ * length is the protocol length field (data size - 1). Read requests are
+ * answered with length + 1 data bytes and their checksum, write requests
+ * carry length + 1 data bytes and their checksum after the header.
+ * timeout is the maximum time to wait for echo and reply (ms).
+ */
+const uint8_t FRAME_READ = 0xf0;
+const uint8_t FRAME_WRITE = 0x0f;
+const uint8_t FRAME_CLOSE = 0x3c;
+
+const size_t HEADER_SIZE = 6;
+const size_t MAX_REQUEST_SIZE = HEADER_SIZE + 8 + 1;
+const size_t MAX_REPLY_SIZE = 64 + 1;
+
+struct Command {
+    uint8_t cmd;
+    uint16_t addr;
+    uint8_t length;
+    uint16_t timeout;
+};
+
+constexpr Command CMD_CTRL_PARTITIONS = {FRAME_WRITE, 0xf000, 0x03, 1000};
+constexpr Command CMD_ZONE_BYPASS = {FRAME_WRITE, 0xf001, 0x07, 100};
+constexpr Command CMD_SET_TIME = {FRAME_WRITE, 0xf003, 0x05, 100};
+constexpr Command CMD_RESET = {FRAME_WRITE, 0xf005, 0x01, 500};
+constexpr Command CMD_CLOSE = {FRAME_CLOSE, 0x0003, 0x00, 100};
+
+// Cheapest request answered by the alarm (1 byte read), used to probe a lost link
+constexpr Command CMD_PROBE = {FRAME_READ, 0x0000, 0x00, 100};
+
+// Data bytes read or written by the command
+constexpr size_t getDataSize(const Command &command) {
+    return ((command.cmd == FRAME_CLOSE) ? 0 : command.length + 1);
+}
+
+// Reply size, checksum included
+constexpr size_t getReplySize(const Command &command) {
+    return ((command.cmd == FRAME_READ) ? getDataSize(command) + 1 : 0);
+}
+
+// Request size, header and data block with checksums included
+constexpr size_t getRequestSize(const Command &command) {
+    return (HEADER_SIZE + ((command.cmd == FRAME_WRITE) ? getDataSize(command) + 1 : 0));
+}
+
+// Header is <cmd><addr LSB><addr MSB><length><0x00><cksum>
+constexpr uint8_t getHeaderChecksum(const Command &command) {
+    return (static_cast<uint8_t>(command.cmd + (command.addr & 0xff) + (command.addr >> 8) + command.length));
+}
+
+static_assert(getHeaderChecksum(Command{FRAME_READ, 0x1502, 0x12, 0}) == 0x19, "Header checksum");
+static_assert(getRequestSize(CMD_ZONE_BYPASS) <= MAX_REQUEST_SIZE, "Request buffer too small");
+
+/*
+ * Panel memory regions
+ * Panel memory areas mirrored in RAM, offsets of decoded fields are relative
+ * to the region address. Regions read together are planned in the fewest
+ * read frames: regions closer than MAX_READ_GAP bytes are read as a single
+ * span, spans are split in frames of at most MAX_READ_SIZE bytes.
+ */
+struct Region {
+    uint16_t addr;
+    uint8_t size;
+    uint16_t timeout;
+};
+
+enum RegionId {REGION_ALARM_INFO, REGION_PINS, REGION_PARTITIONS, REGION_REAL_TIME_STATUS, REGION_STATUS, REGIONS};
+
+constexpr Region REGION_MAP[REGIONS] = {
+    {0x0000, 12, 100},      // Model (bytes 0 - 6) and firmware (bytes 8 - 11)
+    {0x01b4, 72, 500},      // Stored PINs, 3 bytes BCD codes
+    {0x01ff, 2, 100},       // Partitions list (byte 1)
+    {0xf004, 11, 1000},     // Real-time status
+    {0x1502, 19, 1000},     // Partitions and bypass status
+};
+
+static_assert(REGION_MAP[REGION_PINS].size == KYO_STORED_PINS * 3, "PINs region size");
+
+const size_t RT_ZONES = 0;
+const size_t RT_TAMPERS = 4;
+const size_t RT_WARNINGS = 8;
+const size_t RT_ALARMS = 9;
+const size_t RT_TAMPER_FLAGS = 10;
+
+const size_t ST_ARMED = 0;
+const size_t ST_DISARMED = 3;
+const size_t ST_OUTPUTS = 6;
+const size_t ST_BYPASSED = 7;
+const size_t ST_ALARM_MEMORY = 11;
+const size_t ST_TAMPER_MEMORY = 15;
+
+// Reading a few unused bytes is cheaper than a new frame (request, echo and checksum)
+const size_t MAX_READ_SIZE = MAX_REPLY_SIZE - 1;
+const size_t MAX_READ_GAP = 2 * HEADER_SIZE + 1;
+
+constexpr uint32_t getRegionMask(RegionId id) {
+    return (static_cast<uint32_t>(1) << id);
+}
+
+constexpr size_t getMirrorSize(size_t id = 0) {
+    return ((id < REGIONS) ? REGION_MAP[id].size + getMirrorSize(id + 1) : 0);
+}
+
+inline uint8_t getChecksum(const uint8_t *data, size_t size) {
+    uint8_t ckSum = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        ckSum += data[i];
+    }
+
+    return (ckSum);
+}
+
+// Last byte of data is the checksum of the previous bytes
+inline bool verifyChecksum(const uint8_t *data, size_t size) {
+    return ((size > 0) && (data[size - 1] == getChecksum(data, size - 1)));
+}
+
+// Request frame, encoded in place without heap allocation
+struct Frame {
+    uint8_t data[MAX_REQUEST_SIZE];
+    uint8_t size;
+};
+
+// Encode request, data (write requests only) must be getDataSize(command) bytes long
+inline void encode(const Command &command, Frame &frame, const uint8_t *data = nullptr) {
+    frame.data[0] = command.cmd;
+    frame.data[1] = command.addr & 0xff;
+    frame.data[2] = command.addr >> 8;
+    frame.data[3] = command.length;
+    frame.data[4] = 0x00;
+    frame.data[5] = getHeaderChecksum(command);
+    frame.size = HEADER_SIZE;
+
+    if ((command.cmd == FRAME_WRITE) && (data != nullptr)) {
+        size_t size = getDataSize(command);
+
+        memcpy(&frame.data[HEADER_SIZE], data, size);
+        frame.data[HEADER_SIZE + size] = getChecksum(data, size);
+        frame.size += size + 1;
+    }
+}
+
+// Zones masks are sent MSB first
+inline uint32_t getMask(const uint8_t *data) {
+    return ((static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3]);
+}
+
+// Return index of the lowest set bit and clear it, mask must not be 0
+inline int popBit(uint32_t &mask) {
+    int bit = __builtin_ctz(mask);
+
+    mask &= mask - 1;
+    return (bit);
+}
+
+/*
+ * Bit mask change tracker
+ * Keeps the last published mask and returns the bits changed by a new one,
+ * so only changed entities are published. All bits are reported as changed
+ * until a first mask is published or after invalidate(). Bits outside the
+ * tracked bits are ignored.
+ */
+class MaskTracker {
+    public:
+        explicit MaskTracker(uint32_t tracked = 0xffffffff) : bits(tracked) {}
+
+        uint32_t update(uint32_t mask) {
+            uint32_t changed = valid ? (mask ^ value) : bits;
+
+            value = mask & bits;
+            valid = true;
+            return (changed & bits);
+        }
+
+        void invalidate() {
+            valid = false;
+        }
+
+        uint32_t getValue() const {
+            return (value);
+        }
+
+        bool isValid() const {
+            return (valid);
+        }
+
+    private:
+        uint32_t bits;
+        uint32_t value = 0;
+        bool valid = false;
+};
+
+/*
+ * Fixed size FIFO queue
+ * Items can also be pushed at the front, to be processed next, or accessed
+ * by position (0 is the front) to reorder them.
+ */
+template<typename T, size_t N>
+class RingBuffer {
+    public:
+        bool pushBack(const T &item) {
+            if (isFull()) {
+                return (false);
+            }
+
+            items[(head + count) % N] = item;
+            count++;
+            return (true);
+        }
+
+        bool pushFront(const T &item) {
+            if (isFull()) {
+                return (false);
+            }
+
+            head = (head + N - 1) % N;
+            items[head] = item;
+            count++;
+            return (true);
+        }
+
+        bool popFront(T &item) {
+            if (isEmpty()) {
+                return (false);
+            }
+
+            item = items[head];
+            head = (head + 1) % N;
+            count--;
+            return (true);
+        }
+
+        T &operator[](size_t index) {
+            return (items[(head + index) % N]);
+        }
+
+        const T &operator[](size_t index) const {
+            return (items[(head + index) % N]);
+        }
+
+        size_t getSize() const {
+            return (count);
+        }
+
+        bool isEmpty() const {
+            return (count == 0);
+        }
+
+        bool isFull() const {
+            return (count == N);
+        }
+
+        void clear() {
+            head = 0;
+            count = 0;
+        }
+
+    private:
+        T items[N];
+        size_t head = 0;
+        size_t count = 0;
+};
+
+/*
+ * Single-producer single-consumer ring
+ * Lock-free FIFO between two threads: push() is called by one thread only,
+ * pop() by one other thread only. Head and tail only grow and each one is
+ * written by a single side, so plain atomic loads and stores are enough.
+ */
+template<typename T, size_t N>
+class SpscRing {
+    static_assert((N > 0) && ((N & (N - 1)) == 0), "Ring size must be a power of 2");
+
+    public:
+        bool push(const T &item) {
+            size_t tail = last.load(std::memory_order_relaxed);
+
+            if (tail - first.load(std::memory_order_acquire) == N) {
+                return (false);
+            }
+
+            items[tail % N] = item;
+            last.store(tail + 1, std::memory_order_release);
+            return (true);
+        }
+
+        bool pop(T &item) {
+            size_t head = first.load(std::memory_order_relaxed);
+
+            if (head == last.load(std::memory_order_acquire)) {
+                return (false);
+            }
+
+            item = items[head % N];
+            first.store(head + 1, std::memory_order_release);
+            return (true);
+        }
+
+        bool isEmpty() const {
+            return (first.load(std::memory_order_acquire) == last.load(std::memory_order_acquire));
+        }
+
+    private:
+        T items[N];
+        std::atomic<size_t> first{0};
+        std::atomic<size_t> last{0};
+};
+
+/*
+ * Seqlock snapshot
+ * Latest value of T (plain data) handed from one writer thread to reader
+ * threads, neither side ever waits for the other. The writer fills the
+ * back one of two buffers, then makes it the front one; the sequence is odd
+ * while it is writing. A reader copies the front buffer and checks the
+ * sequence again: the copy is torn only if a second write started
+ * meanwhile, since that one fills the buffer being copied.
+ */
+template<typename T>
+class SeqlockSnapshot {
+    public:
+        // Writer side
+        void write(const T &value) {
+            uint32_t seq = sequence.load(std::memory_order_relaxed);
+
+            sequence.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            buffers[((seq >> 1) + 1) & 0x01] = value;
+            sequence.store(seq + 2, std::memory_order_release);
+        }
+
+        // Single attempt, returns false if the copy may be torn
+        bool tryRead(T &value) const {
+            uint32_t seq = sequence.load(std::memory_order_acquire);
+
+            value = buffers[(seq >> 1) & 0x01];
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            return ((sequence.load(std::memory_order_relaxed) - (seq & ~static_cast<uint32_t>(1))) <= 2);
+        }
+
+        void read(T &value) const {
+            while (tryRead(value) == false) {
+            }
+        }
+
+        // Completed writes
+        uint32_t getVersion() const {
+            return (sequence.load(std::memory_order_acquire) >> 1);
+        }
+
+    private:
+        T buffers[2] = {};
+        std::atomic<uint32_t> sequence{0};
+};
+
+/*
+ * Request queue
+ * Requests (T with Priority priority and uint32_t queued fields) ordered
+ * by priority, in FIFO order within the same priority: follow-up requests
+ * (e.g. close frames) go first, then alarm fast-path reads, then user
+ * commands, then routine polls. The deepest queue and the longest wait
+ * since the last resetStats() are kept.
+ */
+enum class Priority {ROUTINE, COMMAND, ALARM, FOLLOW_UP};
+
+template<typename T, size_t N>
+class RequestQueue {
+    public:
+        bool push(const T &request, uint32_t now) {
+            if (items.pushBack(request) == false) {
+                return (false);
+            }
+
+            items[items.getSize() - 1].queued = now;
+
+            // Move request ahead of queued requests with lower priority
+            for (size_t i = items.getSize() - 1; (i > 0) && (items[i - 1].priority < items[i].priority); i--) {
+                std::swap(items[i - 1], items[i]);
+            }
+
+            depthMax = std::max(depthMax, items.getSize());
+            return (true);
+        }
+
+        bool pop(T &request, uint32_t now) {
+            if (items.popFront(request) == false) {
+                return (false);
+            }
+
+            waitMax = std::max(waitMax, now - request.queued);
+            return (true);
+        }
+
+        size_t getSize() const {
+            return (items.getSize());
+        }
+
+        bool isEmpty() const {
+            return (items.isEmpty());
+        }
+
+        void clear() {
+            items.clear();
+        }
+
+        size_t getDepthMax() const {
+            return (depthMax);
+        }
+
+        uint32_t getWaitMax() const {
+            return (waitMax);
+        }
+
+        void resetStats() {
+            depthMax = items.getSize();
+            waitMax = 0;
+        }
+
+    private:
+        RingBuffer<T, N> items;
+        size_t depthMax = 0;
+        uint32_t waitMax = 0;
+};
+
+/*
+ * Poll scheduler
+ * Each poll task has its own interval, the most overdue task runs when
+ * the link is idle. Idle tasks run only if no other task is due. Tasks
+ * enabled, idle tasks and current intervals may change at run time, so
+ * they are passed to select() (bit n of masks is task n).
+ */
+struct PollTask {
+    uint32_t interval;
+    uint32_t lastRun;
+};
+
+template<size_t N>
+class PollScheduler {
+    static_assert(N <= 32, "Too many poll tasks");
+
+    public:
+        void setInterval(size_t id, uint32_t interval) {
+            tasks[id].interval = interval;
+        }
+
+        uint32_t getInterval(size_t id) const {
+            return (tasks[id].interval);
+        }
+
+        // All tasks due at now
+        void reset(uint32_t now) {
+            for (PollTask &task: tasks) {
+                task.lastRun = now - task.interval;
+            }
+        }
+
+        void run(size_t id, uint32_t now) {
+            tasks[id].lastRun = now;
+        }
+
+        uint32_t getLastRun(size_t id) const {
+            return (tasks[id].lastRun);
+        }
+
+        // Time since task was due, negative if not due yet
+        int32_t getLateness(size_t id, uint32_t now, uint32_t interval) const {
+            return (static_cast<int32_t>(now - tasks[id].lastRun - interval));
+        }
+
+        // Most overdue enabled task, -1 if none is due
+        int select(uint32_t now, uint32_t enabled, uint32_t idle, const uint32_t *intervals) const {
+            int32_t maxLateness = 0;
+            bool nextIdle = false;
+            int next = -1;
+
+            for (size_t i = 0; i < N; i++) {
+                int32_t lateness = getLateness(i, now, intervals[i]);
+                bool isIdle = ((idle >> i) & 0x01) != 0;
+
+                if ((((enabled >> i) & 0x01) == 0) || (lateness < 0)) {
+                    continue;
+                }
+
+                // Tasks not idle first, then the most overdue
+                if ((next < 0) || ((nextIdle == true) && (isIdle == false)) || ((isIdle == nextIdle) && (lateness > maxLateness))) {
+                    next = static_cast<int>(i);
+                    nextIdle = isIdle;
+                    maxLateness = lateness;
+                }
+            }
+
+            return (next);
+        }
+
+    private:
+        PollTask tasks[N] = {};
+};
+
+// Plan read frames for the regions in mask, returns the number of frames
+inline size_t planReads(uint32_t regions, Command *frames, size_t maxFrames) {
+    int order[REGIONS];
+    size_t count = 0;
+    size_t n = 0;
+
+    // Regions in address order, inserted one at a time
+    for (int id = 0; id < REGIONS; id++) {
+        if ((regions & getRegionMask(static_cast<RegionId>(id))) != 0) {
+            size_t pos = n++;
+
+            for (; (pos > 0) && (REGION_MAP[order[pos - 1]].addr > REGION_MAP[id].addr); pos--) {
+                order[pos] = order[pos - 1];
+            }
+
+            order[pos] = id;
+        }
+    }
+
+    for (size_t i = 0; i < n;) {
+        uint32_t start = REGION_MAP[order[i]].addr;
+        uint32_t end = start + REGION_MAP[order[i]].size;
+        uint16_t timeout = REGION_MAP[order[i]].timeout;
+
+        // Merge near regions in a single span
+        for (i++; (i < n) && (REGION_MAP[order[i]].addr <= end + MAX_READ_GAP); i++) {
+            end = std::max(end, static_cast<uint32_t>(REGION_MAP[order[i]].addr + REGION_MAP[order[i]].size));
+            timeout = std::max(timeout, REGION_MAP[order[i]].timeout);
+        }
+
+        // Split span in frames
+        for (; (start < end) && (count < maxFrames); start += MAX_READ_SIZE) {
+            uint8_t size = static_cast<uint8_t>(std::min(static_cast<size_t>(end - start), MAX_READ_SIZE));
+
+            frames[count++] = {FRAME_READ, static_cast<uint16_t>(start), static_cast<uint8_t>(size - 1), timeout};
+        }
+    }
+
+    return (count);
+}
+
+/*
+ * Panel memory mirror
+ * Read frames are stored in the mirror of the regions they overlap. Bytes
+ * different from the mirrored ones are tracked as a dirty range per region,
+ * so decoders run only on the fields changed since the last read.
+ */
+class PanelMemory {
+    public:
+        PanelMemory() {
+            size_t offset = 0;
+
+            for (int id = 0; id < REGIONS; id++) {
+                offsets[id] = offset;
+                offset += REGION_MAP[id].size;
+                invalidate(static_cast<RegionId>(id));
+            }
+        }
+
+        // Store data read at addr, returns true if any mirrored byte changed
+        bool store(uint16_t addr, const uint8_t *data, size_t size) {
+            bool changed = false;
+
+            for (int id = 0; id < REGIONS; id++) {
+                const Region &region = REGION_MAP[id];
+                uint32_t first = std::max(static_cast<uint32_t>(addr), static_cast<uint32_t>(region.addr));
+                uint32_t last = std::min(static_cast<uint32_t>(addr + size), static_cast<uint32_t>(region.addr + region.size));
+
+                for (uint32_t a = first; a < last; a++) {
+                    size_t offset = a - region.addr;
+                    uint8_t &byte = mirror[offsets[id] + offset];
+
+                    if ((byte != data[a - addr]) || forced[id]) {
+                        byte = data[a - addr];
+                        dirtyStart[id] = std::min(dirtyStart[id], offset);
+                        dirtyEnd[id] = std::max(dirtyEnd[id], offset + 1);
+                        changed = true;
+                    }
+                }
+            }
+
+            return (changed);
+        }
+
+        const uint8_t *getData(RegionId id) const {
+            return (&mirror[offsets[id]]);
+        }
+
+        size_t getSize(RegionId id) const {
+            return (REGION_MAP[id].size);
+        }
+
+        bool isDirty(RegionId id) const {
+            return (dirtyEnd[id] > dirtyStart[id]);
+        }
+
+        // True if any byte in the field at offset changed
+        bool isDirty(RegionId id, size_t offset, size_t size) const {
+            return ((offset < dirtyEnd[id]) && (offset + size > dirtyStart[id]));
+        }
+
+        void clearDirty(RegionId id) {
+            dirtyStart[id] = REGION_MAP[id].size;
+            dirtyEnd[id] = 0;
+            forced[id] = false;
+        }
+
+        // Next read marks the whole region as changed
+        void invalidate(RegionId id) {
+            clearDirty(id);
+            forced[id] = true;
+        }
+
+    private:
+        uint8_t mirror[getMirrorSize()] = {0};
+        size_t offsets[REGIONS];
+        size_t dirtyStart[REGIONS];
+        size_t dirtyEnd[REGIONS];
+        bool forced[REGIONS];
+};
+
+// Copy a space padded string, trailing spaces are removed
+inline void copyTrimmed(char *dest, const uint8_t *src, size_t size) {
+    while ((size > 0) && std::isspace(src[size - 1])) {
+        size--;
+    }
+
+    memcpy(dest, src, size);
+    dest[size] = '\0';
+}
+
+inline AlarmModel parseModel(const char *model) {
+    if (strcmp(model, KYO_MODEL_4) == 0) return (AlarmModel::KYO_4);
+    if (strcmp(model, KYO_MODEL_8) == 0) return (AlarmModel::KYO_8);
+    if (strcmp(model, KYO_MODEL_8G) == 0) return (AlarmModel::KYO_8G);
+    if (strcmp(model, KYO_MODEL_32) == 0) return (AlarmModel::KYO_32);
+    if (strcmp(model, KYO_MODEL_32G) == 0) return (AlarmModel::KYO_32G);
+    if (strcmp(model, KYO_MODEL_8W) == 0) return (AlarmModel::KYO_8W);
+    if (strcmp(model, KYO_MODEL_8GW) == 0) return (AlarmModel::KYO_8GW);
+    return (AlarmModel::UNKNOWN);
+}
+
+/*
+ * Region decoders
+ * Data is the mirrored region, as returned by PanelMemory::getData().
+ */
+inline bool decodeAlarmInfo(const uint8_t *data, size_t size, AlarmInfo &info) {
+    if (size != REGION_MAP[REGION_ALARM_INFO].size) {
+        return (false);
+    }
+
+    // Model is in bytes 0 - 6, firmware in bytes 8 - 11, space padded
+    copyTrimmed(info.model, &data[0], 7);
+    copyTrimmed(info.firmware, &data[8], size - 8);
+
+    info.alarmModel = parseModel(info.model);
+    return (true);
+}
+
+inline bool decodePartitionsList(const uint8_t *data, size_t size, uint8_t &partsList) {
+    if (size != REGION_MAP[REGION_PARTITIONS].size) {
+        return (false);
+    }
+
+    partsList = data[1];
+    return (true);
+}
+
+inline bool decodeRealTimeStatus(const uint8_t *data, size_t size, RealTimeStatus &status) {
+    if (size != REGION_MAP[REGION_REAL_TIME_STATUS].size) {
+        return (false);
+    }
+
+    status.zones = getMask(&data[RT_ZONES]);
+    status.tampers = getMask(&data[RT_TAMPERS]);
+    status.warnings = data[RT_WARNINGS];
+    status.alarms = data[RT_ALARMS];
+    status.tamperFlags = data[RT_TAMPER_FLAGS];
+    return (true);
+}
+
+inline bool decodeStatus(const uint8_t *data, size_t size, Status &status) {
+    if (size != REGION_MAP[REGION_STATUS].size) {
+        return (false);
+    }
+
+    status.armedAway = data[ST_ARMED];
+    status.armedStay = data[ST_ARMED + 1];
+    status.armedStay0 = data[ST_ARMED + 2];
+    status.disarmed = data[ST_DISARMED];
+    status.outputs = data[ST_OUTPUTS];
+    status.bypassed = getMask(&data[ST_BYPASSED]);
+    status.alarmMemory = getMask(&data[ST_ALARM_MEMORY]);
+    status.tamperMemory = getMask(&data[ST_TAMPER_MEMORY]);
+    return (true);
+}
+
+/*
+ * Panel clock
+ * Same layout as CMD_SET_TIME data: day, month, year (from 2000), hour,
+ * minute, second. Time is handled as seconds since 2000-01-01 00:00:00.
+ */
+constexpr size_t CLOCK_SIZE = 6;
+
+static_assert(CLOCK_SIZE == getDataSize(CMD_SET_TIME), "Clock and set time data size differ");
+
+// Days since 2000-01-01 of a date (year from 2000)
+constexpr uint32_t getClockDays(uint32_t year, uint32_t month, uint32_t day) {
+    // Years start in March so the leap day is the last day of the year, 730425 is 2000-01-01
+    return (365 * (year + 2000 - (month <= 2)) + (year + 2000 - (month <= 2)) / 4 - (year + 2000 - (month <= 2)) / 100 +
+            (year + 2000 - (month <= 2)) / 400 + (153 * ((month + 9) % 12) + 2) / 5 + day - 1 - 730425);
+}
+
+static_assert(getClockDays(0, 1, 1) == 0, "Wrong clock epoch");
+static_assert(getClockDays(0, 3, 1) == 60, "Wrong leap year");
+static_assert(getClockDays(24, 1, 1) == 8766, "Wrong days count");
+
+inline bool decodeClock(const uint8_t *data, size_t size, uint32_t &seconds) {
+    if ((size != CLOCK_SIZE) || (data[0] < 1) || (data[0] > 31) || (data[1] < 1) || (data[1] > 12) ||
+        (data[3] > 23) || (data[4] > 59) || (data[5] > 59)) {
+        return (false);
+    }
+
+    seconds = getClockDays(data[2], data[1], data[0]) * 86400 + data[3] * 3600 + data[4] * 60 + data[5];
+    return (true);
+}
+
+inline void encodeClock(uint32_t seconds, uint8_t *data) {
+    uint32_t days = seconds / 86400;
+    uint32_t year = days / 366;
+    uint32_t month = 1;
+
+    while (getClockDays(year + 1, 1, 1) <= days) {
+        year++;
+    }
+
+    while ((month < 12) && (getClockDays(year, month + 1, 1) <= days)) {
+        month++;
+    }
+
+    data[0] = days - getClockDays(year, month, 1) + 1;
+    data[1] = month;
+    data[2] = year;
+    data[3] = (seconds / 3600) % 24;
+    data[4] = (seconds / 60) % 60;
+    data[5] = seconds % 60;
+}
+
+// Drift of a clock read reply (data and checksum) from reference (s), false if the reply size or the clock is not valid
+inline bool getClockDrift(const uint8_t *reply, size_t size, uint32_t reference, int32_t &drift) {
+    uint32_t clock;
+
+    if ((size != CLOCK_SIZE + 1) || (decodeClock(reply, CLOCK_SIZE, clock) == false)) {
+        return (false);
+    }
+
+    drift = static_cast<int32_t>(clock - reference);
+    return (true);
+}
+
+// Panel clock is written only when off by more than threshold (s), either way
+inline bool isClockOff(int32_t drift, uint32_t threshold) {
+    uint32_t offset = (drift < 0) ? (0u - static_cast<uint32_t>(drift)) : static_cast<uint32_t>(drift);
+
+    return (offset > threshold);
+}
+
+// Encode a 4 - 6 digits PIN as 24 bit BCD code, padded with 0xf
+inline bool encodePin(const std::string &pin, uint32_t &pinCode) {
+    pinCode = 0;
+
+    // Check PIN size (4 - 6 digits)
+    if ((pin.length() < 4) || (pin.length() > 6) || (std::all_of(pin.begin(), pin.end(), ::isdigit) == false)) {
+        return (false);
+    }
+
+    // Encode PIN as unsigned 32 bit integer, padded to 6 digits with 0xf
+    for (size_t i = 0; i < 6; i++) {
+        pinCode <<= 4;
+        pinCode |= (i < pin.length()) ? pin[i] - 0x30 : 0xf;
+    }
+
+    return (true);
+}
+
+/*
+ * Packed state
+ * Zones, tampers and bypassed zones masks, then partitions in alarm, armed
+ * away, armed stay, armed stay with 0 delay and disarmed masks, as fixed
+ * width hex fields separated by ':' (e.g. 00000005:00000000:00000100:00:07:00:00:00).
+ * Bit 0 of each field is zone or partition 1.
+ */
+constexpr size_t PACKED_STATE_SIZE = 3 * 9 + 5 * 3;
+
+// Write value as digits uppercase hex characters followed by sep, returns the next position
+inline char *formatHex(uint32_t value, size_t digits, char sep, char *text) {
+    for (size_t i = 0; i < digits; i++) {
+        text[i] = "0123456789ABCDEF"[(value >> (4 * (digits - 1 - i))) & 0x0f];
+    }
+
+    text[digits] = sep;
+    return (text + digits + 1);
+}
+
+// Encode packed state as a PACKED_STATE_SIZE bytes string, NUL terminated
+inline void encodePackedState(const RealTimeStatus &realTime, const Status &status, char *text) {
+    text = formatHex(realTime.zones, 8, ':', text);
+    text = formatHex(realTime.tampers, 8, ':', text);
+    text = formatHex(status.bypassed, 8, ':', text);
+    text = formatHex(realTime.alarms, 2, ':', text);
+    text = formatHex(status.armedAway, 2, ':', text);
+    text = formatHex(status.armedStay, 2, ':', text);
+    text = formatHex(status.armedStay0, 2, ':', text);
+    formatHex(status.disarmed, 2, '\0', text);
+}
+
+/*
+ * PINs lookup table
+ * PINs stored in the alarm are kept as a sorted array of 24 bit BCD codes,
+ * so a PIN is checked with a binary search without reading the list again.
+ * At most N PINs are kept.
+ */
+template<size_t N>
+class PinTable {
+    public:
+        // Load PINs list stored as 3 bytes BCD codes, unused slots are skipped
+        void load(const uint8_t *pinsList, size_t size) {
+            count = 0;
+
+            for (size_t i = 0; (i + 2 < size) && (count < N); i += 3) {
+                uint32_t pinCode = (pinsList[i] << 16) | (pinsList[i + 1] << 8) | pinsList[i + 2];
+
+                if (isPinCode(pinCode) == true) {
+                    codes[count++] = pinCode;
+                }
+            }
+
+            std::sort(codes, codes + count);
+            valid = true;
+        }
+
+        bool contains(uint32_t pinCode) const {
+            return (valid && std::binary_search(codes, codes + count, pinCode));
+        }
+
+        void invalidate() {
+            valid = false;
+        }
+
+        bool isValid() const {
+            return (valid);
+        }
+
+        size_t getSize() const {
+            return (count);
+        }
+
+    private:
+        uint32_t codes[N];
+        size_t count = 0;
+        bool valid = false;
+
+        // First 4 digits are decimal, last 2 are decimal or 0xf padding
+        static bool isPinCode(uint32_t pinCode) {
+            for (int i = 5; i >= 0; i--) {
+                uint8_t digit = (pinCode >> (i * 4)) & 0x0f;
+
+                if ((digit > 9) && ((i > 1) || (digit != 0x0f))) {
+                    return (false);
+                }
+            }
+
+            return (true);
+        }
+};
+
+// Transaction result, as seen by the frame parser
+enum Result {RESULT_OK, RESULT_TIMEOUT, RESULT_SHORT_REPLY, RESULT_BAD_CHECKSUM, RESULTS};
+
+/*
+ * Streaming frame parser
+ * Bytes are consumed one at a time as they are received: first the request
+ * echo (whole request frame, data included), then the reply data and its
+ * checksum. Bytes not matching the echo are discarded until the echo is found.
+ */
+class FrameParser {
+    public:
+        enum class State {ECHO, REPLY, COMPLETE};
+
+        void begin(const uint8_t *request, size_t requestSize, size_t expectedSize) {
+            echo = request;
+            echoSize = requestSize;
+            echoPos = 0;
+            expected = std::min(expectedSize, MAX_REPLY_SIZE);
+            discarded = 0;
+            replySize = 0;
+            state = (echoSize > 0) ? State::ECHO : nextState();
+        }
+
+        // Consume a received byte, returns true when the frame is complete
+        bool push(uint8_t data) {
+            switch (state) {
+                case State::ECHO:
+                    if (data == echo[echoPos]) {
+                        echoPos++;
+                    } else {
+                        resync(data);
+                    }
+
+                    if (echoPos == echoSize) {
+                        state = nextState();
+                    }
+                    break;
+
+                case State::REPLY:
+                    reply[replySize++] = data;
+
+                    if (replySize == expected) {
+                        state = State::COMPLETE;
+                    }
+                    break;
+
+                case State::COMPLETE:
+                    discarded++;
+                    break;
+            }
+
+            return (state == State::COMPLETE);
+        }
+
+        bool isValid() const {
+            if (state != State::COMPLETE) {
+                return (false);
+            }
+
+            return ((replySize == 0) || verifyChecksum(reply, replySize));
+        }
+
+        State getState() const {
+            return (state);
+        }
+
+        const uint8_t *getReply() const {
+            return (reply);
+        }
+
+        size_t getReplySize() const {
+            return (replySize);
+        }
+
+        size_t getDiscarded() const {
+            return (discarded);
+        }
+
+        // Result of the transaction, incomplete frames are a timeout or a short reply
+        Result getResult() const {
+            if (state == State::COMPLETE) {
+                return (isValid() ? RESULT_OK : RESULT_BAD_CHECKSUM);
+            }
+
+            return ((replySize > 0) ? RESULT_SHORT_REPLY : RESULT_TIMEOUT);
+        }
+
+    private:
+        const uint8_t *echo = nullptr;
+        size_t echoSize = 0;
+        size_t echoPos = 0;
+        size_t expected = 0;
+        size_t discarded = 0;
+        uint8_t reply[MAX_REPLY_SIZE];
+        size_t replySize = 0;
+        State state = State::COMPLETE;
+
+        State nextState() const {
+            return ((expected > 0) ? State::REPLY : State::COMPLETE);
+        }
+
+        void resync(uint8_t data) {
+            size_t matched = echoPos;
+
+            // Find the longest echo prefix ending with the received byte
+            while (matched > 0) {
+                if ((echo[matched - 1] == data) && (memcmp(echo, &echo[echoPos - matched + 1], matched - 1) == 0)) {
+                    break;
+                }
+
+                matched--;
+            }
+
+            discarded += echoPos + 1 - matched;
+            echoPos = matched;
+        }
+};
+
+/*
+ * Link statistics
+ * Transaction results per command, round-trip latency histogram of
+ * completed transactions and bytes counters. Counters are fixed size and
+ * updated in constant time, they wrap around on overflow.
+ */
+enum StatId {
+    // Reads, same order as regions
+    STAT_ALARM_INFO, STAT_PINS, STAT_PARTITIONS, STAT_REAL_TIME_STATUS, STAT_STATUS, STAT_CLOCK,
+    // Writes
+    STAT_CTRL_PARTITIONS, STAT_ZONE_BYPASS, STAT_SET_TIME, STAT_RESET, STAT_CLOSE,
+    STATS
+};
+
+const char *const STAT_NAMES[STATS] = {
+    "alarm info", "pins", "partitions", "real-time status", "status", "clock",
+    "ctrl partitions", "zone bypass", "set time", "reset", "close"
+};
+
+static_assert(STAT_STATUS == static_cast<int>(REGION_STATUS), "Read stats must match regions");
+
+// Upper bounds of latency histogram buckets (ms), last bucket is unbounded
+const uint16_t LATENCY_BOUNDS[] = {20, 50, 100, 200, 500, 1000};
+const size_t LATENCY_BUCKETS = sizeof(LATENCY_BOUNDS) / sizeof(LATENCY_BOUNDS[0]) + 1;
+
+inline StatId getStatId(const Command &command) {
+    if (command.cmd == FRAME_READ) {
+        // Read frames are counted on the region they start in
+        for (int id = 0; id < REGIONS; id++) {
+            if ((command.addr >= REGION_MAP[id].addr) && (command.addr < REGION_MAP[id].addr + REGION_MAP[id].size)) {
+                return (static_cast<StatId>(id));
+            }
+        }
+
+        // Clock is the only read outside regions
+        return (STAT_CLOCK);
+    }
+
+    if (command.cmd == FRAME_CLOSE) return (STAT_CLOSE);
+    if (command.addr == CMD_ZONE_BYPASS.addr) return (STAT_ZONE_BYPASS);
+    if (command.addr == CMD_SET_TIME.addr) return (STAT_SET_TIME);
+    if (command.addr == CMD_RESET.addr) return (STAT_RESET);
+    return (STAT_CTRL_PARTITIONS);
+}
+
+class LinkStats {
+    public:
+        void record(StatId id, Result result, uint32_t latency) {
+            size_t bucket = 0;
+
+            results[id][result]++;
+
+            if (result != RESULT_OK) {
+                return;
+            }
+
+            while ((bucket < LATENCY_BUCKETS - 1) && (latency > LATENCY_BOUNDS[bucket])) {
+                bucket++;
+            }
+
+            latencyBuckets[bucket]++;
+            latencySum += latency;
+        }
+
+        void addBytesIn(size_t size) {
+            bytesIn += size;
+        }
+
+        void addBytesOut(size_t size) {
+            bytesOut += size;
+        }
+
+        uint32_t getCount(StatId id, Result result) const {
+            return (results[id][result]);
+        }
+
+        // Transactions with the given result, all commands
+        uint32_t getCount(Result result) const {
+            uint32_t count = 0;
+
+            for (int id = 0; id < STATS; id++) {
+                count += results[id][result];
+            }
+
+            return (count);
+        }
+
+        uint32_t getErrors() const {
+            return (getCount(RESULT_TIMEOUT) + getCount(RESULT_SHORT_REPLY) + getCount(RESULT_BAD_CHECKSUM));
+        }
+
+        uint32_t getLatencyBucket(size_t bucket) const {
+            return (latencyBuckets[bucket]);
+        }
+
+        // Sum of completed transactions latency (ms)
+        uint32_t getLatencySum() const {
+            return (latencySum);
+        }
+
+        uint32_t getBytesIn() const {
+            return (bytesIn);
+        }
+
+        uint32_t getBytesOut() const {
+            return (bytesOut);
+        }
+
+    private:
+        uint32_t results[STATS][RESULTS] = {};
+        uint32_t latencyBuckets[LATENCY_BUCKETS] = {};
+        uint32_t latencySum = 0;
+        uint32_t bytesIn = 0;
+        uint32_t bytesOut = 0;
+};
+
+/*
+ * Reply handler statistics
+ * Time spent handling replies (decode and publish), in us. Kept apart from
+ * the link statistics, since handlers may run on another thread than the
+ * link. Requests without a handler (e.g. probes) are not counted.
+ */
+class HandlerStats {
+    public:
+        void record(StatId id, uint32_t time) {
+            count[id]++;
+            sum[id] += time;
+            max[id] = std::max(max[id], time);
+        }
+
+        uint32_t getAverage(StatId id) const {
+            return ((count[id] > 0) ? sum[id] / count[id] : 0);
+        }
+
+        uint32_t getMax(StatId id) const {
+            return (max[id]);
+        }
+
+    private:
+        uint32_t count[STATS] = {};
+        uint32_t sum[STATS] = {};
+        uint32_t max[STATS] = {};
+};
+
+/*
+ * Link health
+ * healthy -> degraded on a failed request, degraded -> down after a
+ * number of consecutive failures, back to healthy on the first successful
+ * request. While down only probe frames should be sent, isProbeDue() tells
+ * when: the probe interval doubles after each failed probe.
+ */
+enum class LinkHealth {HEALTHY, DEGRADED, DOWN};
+
+class HealthMonitor {
+    public:
+        enum class Event {NONE, CHANGED, DOWN, RESTORED};
+
+        HealthMonitor(uint32_t downFailures, uint32_t probeMin, uint32_t probeMax) :
+            downFailures(downFailures), probeMin(probeMin), probeMax(probeMax), probeInterval(probeMin) {}
+
+        // Result of a request, returns DOWN or RESTORED on those transitions, CHANGED on the others
+        Event update(bool success, uint32_t now) {
+            LinkHealth previous = health;
+
+            if (success == true) {
+                failures = 0;
+                health = LinkHealth::HEALTHY;
+                return ((previous == LinkHealth::DOWN) ? Event::RESTORED : ((previous != health) ? Event::CHANGED : Event::NONE));
+            }
+
+            failures++;
+
+            if (health == LinkHealth::DOWN) {
+                // Failed probe, back off
+                probeInterval = std::min(probeInterval * 2, probeMax);
+                probeNext = now + probeInterval;
+                return (Event::NONE);
+            }
+
+            if (failures >= downFailures) {
+                health = LinkHealth::DOWN;
+                probeInterval = probeMin;
+                probeNext = now + probeInterval;
+                return (Event::DOWN);
+            }
+
+            health = LinkHealth::DEGRADED;
+            return ((previous != health) ? Event::CHANGED : Event::NONE);
+        }
+
+        LinkHealth getHealth() const {
+            return (health);
+        }
+
+        bool isDown() const {
+            return (health == LinkHealth::DOWN);
+        }
+
+        bool isProbeDue(uint32_t now) const {
+            return (isDown() && (static_cast<int32_t>(now - probeNext) >= 0));
+        }
+
+        static const char *getName(LinkHealth health) {
+            static const char *const names[] = {"healthy", "degraded", "down"};
+
+            return (names[static_cast<int>(health)]);
+        }
+
+    private:
+        uint32_t downFailures;
+        uint32_t probeMin;
+        uint32_t probeMax;
+        uint32_t probeInterval;
+        uint32_t probeNext = 0;
+        uint32_t failures = 0;
+        LinkHealth health = LinkHealth::HEALTHY;
+};
+
+/*
+ * Event journal
+ * State changes are appended to a byte ring as compact records: time from
+ * previous record in JOURNAL_TICK_MS ticks (7 bits per byte, MSB set on all
+ * bytes but the last), then one byte with event type (bits 7-6), value
+ * (bit 5) and index (bits 4-0, zone or alarm status). A zone change
+ * within 12.7 s of the previous one takes 2 bytes. Oldest records are
+ * dropped to make room, each record keeps its sequence number.
+ */
+enum EventType {EVENT_ZONE, EVENT_TAMPER, EVENT_BYPASS, EVENT_STATUS};
+
+constexpr uint32_t JOURNAL_TICK_MS = 100;
+
+struct Event {
+    uint32_t seq;
+    uint32_t time;
+    EventType type;
+    uint8_t index;
+    bool value;
+};
+
+template<size_t N>
+class EventJournal {
+    static_assert(N >= 8, "Journal can't hold a record");
+
+    public:
+        // Position of a reader, see next()
+        struct Cursor {
+            uint32_t seq;
+            size_t pos;
+            uint32_t ticks;
+        };
+
+        void append(uint32_t time, EventType type, uint8_t index, bool value) {
+            uint32_t ticks = time / JOURNAL_TICK_MS;
+            uint32_t delta = (count > 0) ? ticks - lastTicks : 0;
+            uint8_t record[6];
+            size_t size = 0;
+
+            do {
+                record[size] = delta & 0x7f;
+                delta >>= 7;
+                record[size] |= (delta > 0) ? 0x80 : 0x00;
+                size++;
+            } while (delta > 0);
+
+            record[size++] = (type << 6) | (value ? 0x20 : 0x00) | (index & 0x1f);
+
+            while (N - used < size) {
+                drop();
+            }
+
+            if (count == 0) {
+                headTicks = ticks;
+            }
+
+            for (size_t i = 0; i < size; i++) {
+                data[(head + used + i) % N] = record[i];
+            }
+
+            used += size;
+            count++;
+            lastTicks = ticks;
+        }
+
+        // Cursor at the oldest record
+        Cursor begin() const {
+            return (Cursor{headSeq, head, headTicks});
+        }
+
+        // Read record at cursor and move to the next one, a cursor on dropped records restarts from the oldest
+        bool next(Cursor &cursor, Event &event) const {
+            uint32_t delta = 0;
+            size_t shift = 0;
+            uint8_t byte;
+
+            if (cursor.seq < headSeq) {
+                cursor = begin();
+            }
+
+            if (cursor.seq >= headSeq + count) {
+                return (false);
+            }
+
+            do {
+                byte = data[cursor.pos];
+                cursor.pos = (cursor.pos + 1) % N;
+                delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                shift += 7;
+            } while ((byte & 0x80) != 0);
+
+            // Delta of the oldest record refers to a dropped one
+            if (cursor.seq == headSeq) {
+                cursor.ticks = headTicks;
+            } else {
+                cursor.ticks += delta;
+            }
+
+            byte = data[cursor.pos];
+            cursor.pos = (cursor.pos + 1) % N;
+
+            event.seq = cursor.seq++;
+            event.time = cursor.ticks * JOURNAL_TICK_MS;
+            event.type = static_cast<EventType>(byte >> 6);
+            event.value = (byte & 0x20) != 0;
+            event.index = byte & 0x1f;
+            return (true);
+        }
+
+        size_t getCount() const {
+            return (count);
+        }
+
+        // Sequence number of next record
+        uint32_t getEnd() const {
+            return (headSeq + count);
+        }
+
+        // Records not read yet by cursor
+        uint32_t getUnread(const Cursor &cursor) const {
+            return (getEnd() - std::max(cursor.seq, headSeq));
+        }
+
+    private:
+        uint8_t data[N];
+        size_t head = 0;
+        size_t used = 0;
+        size_t count = 0;
+        uint32_t headSeq = 0;
+        uint32_t headTicks = 0;
+        uint32_t lastTicks = 0;
+
+        void drop() {
+            Cursor cursor = begin();
+            Event event;
+
+            // Skip oldest record, the next one becomes the head with its absolute time
+            next(cursor, event);
+            Cursor following = cursor;
+            bool more = next(following, event);
+
+            used -= (cursor.pos + N - head) % N;
+            head = cursor.pos;
+            headSeq = cursor.seq;
+            count--;
+
+            if (more == true) {
+                headTicks = event.time / JOURNAL_TICK_MS;
+            }
+        }
+};
+
+/*
+ * Link capture
+ * Each exchange is kept in a byte ring as a record of CAPTURE_HEADER_SIZE
+ * bytes: request size, received size, result, start time (ms, LSB first),
+ * time of first and last received byte from start (ms, LSB first), followed
+ * by the request and all received bytes (echo included). Oldest records are
+ * dropped to make room for new ones. The same record layout, base64
+ * encoded, is the text form dumped to the log and loaded by the host
+ * replay tool.
+ */
+constexpr size_t CAPTURE_HEADER_SIZE = 11;
+constexpr size_t MAX_CAPTURE_RX_SIZE = MAX_REQUEST_SIZE + MAX_REPLY_SIZE;
+constexpr size_t MAX_CAPTURE_RECORD_SIZE = CAPTURE_HEADER_SIZE + MAX_REQUEST_SIZE + MAX_CAPTURE_RX_SIZE;
+
+// Base64 text of a record, NUL included
+constexpr size_t CAPTURE_TEXT_SIZE = (MAX_CAPTURE_RECORD_SIZE + 2) / 3 * 4 + 1;
+
+struct CaptureRecord {
+    uint32_t start;
+    uint16_t firstByte;
+    uint16_t lastByte;
+    Result result;
+    uint8_t request[MAX_REQUEST_SIZE];
+    uint8_t requestSize;
+    uint8_t received[MAX_CAPTURE_RX_SIZE];
+    uint8_t receivedSize;
+};
+
+// Encode record, data must be MAX_CAPTURE_RECORD_SIZE bytes long, returns the record size
+inline size_t encodeCapture(const CaptureRecord &record, uint8_t *data) {
+    data[0] = record.requestSize;
+    data[1] = record.receivedSize;
+    data[2] = record.result;
+    data[3] = record.start & 0xff;
+    data[4] = (record.start >> 8) & 0xff;
+    data[5] = (record.start >> 16) & 0xff;
+    data[6] = record.start >> 24;
+    data[7] = record.firstByte & 0xff;
+    data[8] = record.firstByte >> 8;
+    data[9] = record.lastByte & 0xff;
+    data[10] = record.lastByte >> 8;
+    memcpy(&data[CAPTURE_HEADER_SIZE], record.request, record.requestSize);
+    memcpy(&data[CAPTURE_HEADER_SIZE + record.requestSize], record.received, record.receivedSize);
+
+    return (CAPTURE_HEADER_SIZE + record.requestSize + record.receivedSize);
+}
+
+inline bool decodeCapture(const uint8_t *data, size_t size, CaptureRecord &record) {
+    if ((size < CAPTURE_HEADER_SIZE) || (data[0] < HEADER_SIZE) || (data[0] > MAX_REQUEST_SIZE) ||
+        (data[1] > MAX_CAPTURE_RX_SIZE) || (data[2] >= RESULTS) || (size != CAPTURE_HEADER_SIZE + data[0] + data[1])) {
+        return (false);
+    }
+
+    record.requestSize = data[0];
+    record.receivedSize = data[1];
+    record.result = static_cast<Result>(data[2]);
+    record.start = data[3] | (data[4] << 8) | (data[5] << 16) | (static_cast<uint32_t>(data[6]) << 24);
+    record.firstByte = data[7] | (data[8] << 8);
+    record.lastByte = data[9] | (data[10] << 8);
+    memcpy(record.request, &data[CAPTURE_HEADER_SIZE], record.requestSize);
+    memcpy(record.received, &data[CAPTURE_HEADER_SIZE + record.requestSize], record.receivedSize);
+
+    return (true);
+}
+
+const char BASE64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Record as base64 text, text must be CAPTURE_TEXT_SIZE bytes long
+inline void formatCapture(const CaptureRecord &record, char *text) {
+    uint8_t data[MAX_CAPTURE_RECORD_SIZE];
+    size_t size = encodeCapture(record, data);
+
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t block = (data[i] << 16) | (((i + 1) < size) ? (data[i + 1] << 8) : 0) | (((i + 2) < size) ? data[i + 2] : 0);
+
+        *text++ = BASE64_CHARS[block >> 18];
+        *text++ = BASE64_CHARS[(block >> 12) & 0x3f];
+        *text++ = ((i + 1) < size) ? BASE64_CHARS[(block >> 6) & 0x3f] : '=';
+        *text++ = ((i + 2) < size) ? BASE64_CHARS[block & 0x3f] : '=';
+    }
+
+    *text = '\0';
+}
+
+// Record from base64 text, decoding stops at the first character not in base64
+inline bool parseCapture(const char *text, CaptureRecord &record) {
+    uint8_t data[MAX_CAPTURE_RECORD_SIZE];
+    uint32_t block = 0;
+    size_t bits = 0;
+    size_t size = 0;
+
+    for (; *text != '\0'; text++) {
+        const char *pos = strchr(BASE64_CHARS, *text);
+
+        if ((*text == '=') || (pos == nullptr)) {
+            break;
+        }
+
+        block = (block << 6) | (pos - BASE64_CHARS);
+        bits += 6;
+
+        if (bits >= 8) {
+            if (size == sizeof(data)) {
+                return (false);
+            }
+
+            bits -= 8;
+            data[size++] = (block >> bits) & 0xff;
+        }
+    }
+
+    return (decodeCapture(data, size, record));
+}
+
+template<size_t N>
+class CaptureBuffer {
+    static_assert(N >= MAX_CAPTURE_RECORD_SIZE, "Capture buffer can't hold a record");
+
+    public:
+        void push(const CaptureRecord &record) {
+            uint8_t bytes[MAX_CAPTURE_RECORD_SIZE];
+            size_t size = encodeCapture(record, bytes);
+
+            while (N - used < size) {
+                drop();
+            }
+
+            for (size_t i = 0; i < size; i++) {
+                data[(head + used + i) % N] = bytes[i];
+            }
+
+            used += size;
+            count++;
+        }
+
+        // Read record by index, 0 is the oldest
+        bool read(size_t index, CaptureRecord &record) const {
+            uint8_t bytes[MAX_CAPTURE_RECORD_SIZE];
+            size_t pos = head;
+
+            if (index >= count) {
+                return (false);
+            }
+
+            while (index-- > 0) {
+                pos = (pos + recordSize(pos)) % N;
+            }
+
+            for (size_t i = 0; i < recordSize(pos); i++) {
+                bytes[i] = data[(pos + i) % N];
+            }
+
+            return (decodeCapture(bytes, recordSize(pos), record));
+        }
+
+        void clear() {
+            head = 0;
+            used = 0;
+            count = 0;
+            dropped = 0;
+        }
+
+        size_t getCount() const {
+            return (count);
+        }
+
+        // Records dropped to make room since last clear
+        uint32_t getDropped() const {
+            return (dropped);
+        }
+
+    private:
+        uint8_t data[N];
+        size_t head = 0;
+        size_t used = 0;
+        size_t count = 0;
+        uint32_t dropped = 0;
+
+        size_t recordSize(size_t pos) const {
+            return (CAPTURE_HEADER_SIZE + data[pos] + data[(pos + 1) % N]);
+        }
+
+        void drop() {
+            size_t size = recordSize(head);
+
+            head = (head + size) % N;
+            used -= size;
+            count--;
+            dropped++;
+        }
+};
+
+// Feed a captured exchange to a parser, as received from the link
+inline Result replay(const CaptureRecord &record, FrameParser &parser) {
+    Command command = {record.request[0], static_cast<uint16_t>(record.request[1] | (record.request[2] << 8)), record.request[3], 0};
+
+    parser.begin(record.request, record.requestSize, getReplySize(command));
+
+    for (size_t i = 0; i < record.receivedSize; i++) {
+        if (parser.push(record.received[i]) == true) {
+            break;
+        }
+    }
+
+    return (parser.getResult());
+}
+
+// Replay a captured exchange and store a valid read reply in the memory mirror, as the component does
+inline Result replay(const CaptureRecord &record, FrameParser &parser, PanelMemory &memory) {
+    Result result = replay(record, parser);
+
+    if ((result == RESULT_OK) && (record.request[0] == FRAME_READ) && (parser.getReplySize() > 0)) {
+        memory.store(record.request[1] | (record.request[2] << 8), parser.getReply(), parser.getReplySize() - 1);
+    }
+
+    return (result);
+}
+
+/*
+ * Link
+ * One request/reply exchange at a time over transport T, which must provide
+ * int available(), uint8_t read() and write_array(const uint8_t *, size_t)
+ * like the ESPHome UARTDevice (a tty or pty wrapper works as well). Time is
+ * passed in (ms) and all state is per instance, so a process can drive many
+ * alarms, each one with its own link.
+ */
+template<typename T>
+class Link {
+    public:
+        enum class State {IDLE, WAIT_ECHO, WAIT_REPLY};
+        enum class Event {NONE, COMPLETE, TIMEOUT};
+
+        explicit Link(T &port) : transport(port) {}
+
+        // Flush stale received bytes and send request
+        void start(const Frame &request, const Command &command, uint32_t now) {
+            while (transport.available() > 0) {
+                transport.read();
+                stats.addBytesIn(1);
+            }
+
+            transport.write_array(request.data, request.size);
+            stats.addBytesOut(request.size);
+
+            if (record != nullptr) {
+                record->start = now;
+                record->firstByte = 0;
+                record->lastByte = 0;
+                record->requestSize = request.size;
+                record->receivedSize = 0;
+                memcpy(record->request, request.data, request.size);
+            }
+
+            current = &command;
+            started = now;
+            deadline = now + command.timeout;
+            parser.begin(request.data, request.size, getReplySize(command));
+            state = State::WAIT_ECHO;
+        }
+
+        // Consume received bytes, returns COMPLETE as soon as the frame is in or TIMEOUT
+        Event process(uint32_t now) {
+            if (state == State::IDLE) {
+                return (Event::NONE);
+            }
+
+            while (transport.available() > 0) {
+                uint8_t data = transport.read();
+
+                stats.addBytesIn(1);
+
+                if (record != nullptr) {
+                    recordByte(data, now);
+                }
+
+                if (parser.push(data) == true) {
+                    complete(now);
+                    return (Event::COMPLETE);
+                }
+            }
+
+            if (parser.getState() == FrameParser::State::REPLY) {
+                state = State::WAIT_REPLY;
+            }
+
+            if (static_cast<int32_t>(now - deadline) >= 0) {
+                complete(now);
+                return (Event::TIMEOUT);
+            }
+
+            return (Event::NONE);
+        }
+
+        // Keep each exchange in target until the next one starts, nullptr stops recording
+        void setRecording(CaptureRecord *target) {
+            record = target;
+        }
+
+        bool isIdle() const {
+            return (state == State::IDLE);
+        }
+
+        // State before the last completion, tells an echo timeout from a reply timeout
+        State getWaitState() const {
+            return (waitState);
+        }
+
+        const FrameParser &getParser() const {
+            return (parser);
+        }
+
+        const Command &getCommand() const {
+            return (*current);
+        }
+
+        uint32_t getStart() const {
+            return (started);
+        }
+
+        uint32_t getDeadline() const {
+            return (deadline);
+        }
+
+        const LinkStats &getStats() const {
+            return (stats);
+        }
+
+        LinkStats &getStats() {
+            return (stats);
+        }
+
+        // Last exchange, nullptr if not recording
+        const CaptureRecord *getRecord() const {
+            return (record);
+        }
+
+    private:
+        T &transport;
+        State state = State::IDLE;
+        State waitState = State::IDLE;
+        FrameParser parser;
+        const Command *current = nullptr;
+        uint32_t started = 0;
+        uint32_t deadline = 0;
+        LinkStats stats;
+        CaptureRecord *record = nullptr;
+
+        void recordByte(uint8_t data, uint32_t now) {
+            uint16_t elapsed = std::min(now - record->start, static_cast<uint32_t>(UINT16_MAX));
+
+            if (record->receivedSize == 0) {
+                record->firstByte = elapsed;
+            }
+
+            if (record->receivedSize < MAX_CAPTURE_RX_SIZE) {
+                record->received[record->receivedSize++] = data;
+            }
+
+            record->lastByte = elapsed;
+        }
+
+        void complete(uint32_t now) {
+            waitState = state;
+            state = State::IDLE;
+            stats.record(getStatId(*current), parser.getResult(), now - started);
+
+            if (record != nullptr) {
+                record->result = parser.getResult();
+            }
+        }
+};
+
+/*
+ * Link worker
+ * Runs a Link on its own thread or task, which calls service() in a loop.
+ * The client thread submits requests through a lock-free ring and gets each
+ * completed exchange back through a seqlock snapshot, along with the link
+ * statistics at that time, so neither thread ever blocks the other. The
+ * client submits a request only after the previous one completed.
+ */
+struct LinkResult {
+    uint32_t job;           // Sequence number of the completed request
+    bool timeout;
+    bool echoTimeout;       // Timed out waiting for the echo (otherwise for the reply)
+    uint32_t start;
+    FrameParser parser;     // Reply and result, the echo pointer is not valid
+    LinkStats stats;
+};
+
+template<typename T>
+class LinkWorker {
+    public:
+        explicit LinkWorker(Link<T> &target) : link(target) {}
+
+        // Client side, returns false if the worker has not taken the previous request yet
+        bool submit(const Frame &request, const Command &command) {
+            Job job = {request, &command, submitted + 1};
+
+            if (jobs.push(job) == false) {
+                return (false);
+            }
+
+            submitted++;
+            return (true);
+        }
+
+        // Client side, returns true once the last submitted request is complete
+        bool poll(LinkResult &result) {
+            uint32_t version = results.getVersion();
+
+            if (version == taken) {
+                return (false);
+            }
+
+            results.read(result);
+            taken = version;
+            return (result.job == submitted);
+        }
+
+        // Worker side: start a submitted request, consume received bytes and hand back the result
+        void service(uint32_t now) {
+            typedef typename Link<T>::Event Event;
+
+            if (link.isIdle() == true) {
+                if (jobs.pop(current) == false) {
+                    return;
+                }
+
+                link.start(current.request, *current.command, now);
+            }
+
+            Event event = link.process(now);
+
+            if (event == Event::NONE) {
+                return;
+            }
+
+            result.job = current.id;
+            result.timeout = (event == Event::TIMEOUT);
+            result.echoTimeout = (link.getWaitState() == Link<T>::State::WAIT_ECHO);
+            result.start = link.getStart();
+            result.parser = link.getParser();
+            result.stats = link.getStats();
+            results.write(result);
+        }
+
+    private:
+        struct Job {
+            Frame request;
+            const Command *command;
+            uint32_t id;
+        };
+
+        Link<T> &link;
+        SpscRing<Job, 2> jobs;
+        SeqlockSnapshot<LinkResult> results;
+
+        // Client side
+        uint32_t submitted = 0;
+        uint32_t taken = 0;
+
+        // Worker side
+        Job current;
+        LinkResult result;
+};
+
+}  // namespace kyo_protocol
@@ -0,0 +1,230 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Allocation test
+ * Runs the steady-state poll loop of the component (poll scheduler,
+ * prioritized request queue, encoding, link, memory mirror, decoders,
+ * change trackers and PIN lookup) against the simulator and checks that
+ * it does not allocate from the heap. The same loop keeping a heap copy
+ * of each reply is counted too, so a counter that never counts fails.
+ * Only allocations of the test thread are counted, the simulator thread
+ * is free to allocate.
+ */
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "kyo-simulator.h"
+#include "test.h"
+
+using namespace kyo_protocol;
+
+static thread_local bool counting = false;
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+    void *ptr = malloc(size);
+
+    if (counting == true) {
+        allocations++;
+    }
+
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return (ptr);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+enum PollTaskId {POLL_REAL_TIME_STATUS, POLL_STATUS, POLL_PINS, POLL_TASKS};
+
+static const size_t PLAN_FRAMES = 4;
+static const int WARMUP_STEPS = 40;
+
+struct Request {
+    Frame frame;
+    const Command *command;
+    Priority priority;
+    uint32_t queued;
+};
+
+// Component state driven by the loop
+struct Poller {
+    RequestQueue<Request, 8> queue;
+    PollScheduler<POLL_TASKS> scheduler;
+    Command frames[POLL_TASKS][PLAN_FRAMES];
+    size_t frameCount[POLL_TASKS];
+    PanelMemory memory;
+    RealTimeStatus realTime = {};
+    Status status = {};
+    MaskTracker zones;
+    MaskTracker bypassed;
+    PinTable<KYO_STORED_PINS> pins;
+    uint32_t reads[POLL_TASKS] = {};
+};
+
+static void queueReads(Poller &poller, int task, Priority priority, uint32_t now) {
+    for (size_t i = 0; i < poller.frameCount[task]; i++) {
+        Request request;
+
+        encode(poller.frames[task][i], request.frame);
+        request.command = &poller.frames[task][i];
+        request.priority = priority;
+        CHECK(poller.queue.push(request, now));
+    }
+
+    poller.reads[task]++;
+}
+
+// Run steps exchanges, returns the heap allocations made after the warm-up steps
+static size_t runLoop(Poller &poller, TtyLink &link, kyo_host::TtyTransport &port, kyo_host::PanelSimulator &simulator,
+                      int steps, bool copyReplies) {
+    static const uint32_t intervals[POLL_TASKS] = {0, 20, 1000};
+    uint32_t pinCode = 0;
+    uint32_t zonesSet = 0;
+    Request request;
+
+    CHECK(encodePin("123456", pinCode));
+
+    for (int i = 0; i < POLL_TASKS; i++) {
+        poller.scheduler.setInterval(i, intervals[i]);
+    }
+
+    poller.scheduler.reset(kyo_host::getMillis());
+    allocations = 0;
+
+    for (int step = 0; step < WARMUP_STEPS + steps; step++) {
+        uint32_t now = kyo_host::getMillis();
+        int next;
+
+        // Allocations of the first steps (e.g. lazily created stdio buffers) are not steady-state
+        counting = (step >= WARMUP_STEPS);
+
+        // A user command now and then, its PINs read goes ahead of routine polls
+        if ((step % 16) == 0) {
+            queueReads(poller, POLL_PINS, Priority::COMMAND, now);
+        }
+
+        // Poll only when the queue is empty, the PINs task is idle
+        if (poller.queue.isEmpty() == true) {
+            next = poller.scheduler.select(now, (1 << POLL_TASKS) - 1, 1 << POLL_PINS, intervals);
+            if (next >= 0) {
+                poller.scheduler.run(next, now);
+                queueReads(poller, next, Priority::ROUTINE, now);
+            }
+        }
+
+        if (poller.queue.pop(request, now) == false) {
+            continue;
+        }
+
+        if (request.command->addr == REGION_MAP[REGION_REAL_TIME_STATUS].addr) {
+            zonesSet = static_cast<uint32_t>(step);
+            simulator.setZones(zonesSet);
+        }
+
+        link.start(request.frame, *request.command, now);
+
+        while (link.process(kyo_host::getMillis()) == TtyLink::Event::NONE) {
+            port.wait(1);
+        }
+
+        CHECK(link.getParser().isValid());
+
+        if (copyReplies == true) {
+            std::vector<uint8_t> reply(link.getParser().getReply(), link.getParser().getReply() + link.getParser().getReplySize());
+
+            poller.memory.store(request.command->addr, reply.data(), reply.size() - 1);
+        } else {
+            poller.memory.store(request.command->addr, link.getParser().getReply(), link.getParser().getReplySize() - 1);
+        }
+
+        if (poller.memory.isDirty(REGION_REAL_TIME_STATUS)) {
+            decodeRealTimeStatus(poller.memory.getData(REGION_REAL_TIME_STATUS), poller.memory.getSize(REGION_REAL_TIME_STATUS),
+                                 poller.realTime);
+            poller.zones.update(poller.realTime.zones);
+            poller.memory.clearDirty(REGION_REAL_TIME_STATUS);
+            CHECK(poller.zones.getValue() == zonesSet);
+        }
+
+        if (poller.memory.isDirty(REGION_STATUS)) {
+            decodeStatus(poller.memory.getData(REGION_STATUS), poller.memory.getSize(REGION_STATUS), poller.status);
+            poller.bypassed.update(poller.status.bypassed);
+            poller.memory.clearDirty(REGION_STATUS);
+        }
+
+        if (poller.memory.isDirty(REGION_PINS)) {
+            poller.pins.load(poller.memory.getData(REGION_PINS), poller.memory.getSize(REGION_PINS));
+            poller.memory.clearDirty(REGION_PINS);
+        }
+
+        CHECK(poller.pins.contains(pinCode));
+    }
+
+    counting = false;
+    return (allocations);
+}
+
+int main() {
+    kyo_host::SimulatorConfig config;
+    config.baudRate = 0;
+
+    kyo_host::PanelSimulator simulator(config);
+    kyo_host::TtyTransport port;
+    Poller poller;
+    size_t steady;
+    size_t control;
+
+    poller.frameCount[POLL_REAL_TIME_STATUS] = planReads(getRegionMask(REGION_REAL_TIME_STATUS), poller.frames[POLL_REAL_TIME_STATUS],
+                                                         PLAN_FRAMES);
+    poller.frameCount[POLL_STATUS] = planReads(getRegionMask(REGION_STATUS), poller.frames[POLL_STATUS], PLAN_FRAMES);
+    poller.frameCount[POLL_PINS] = planReads(getRegionMask(REGION_PINS), poller.frames[POLL_PINS], PLAN_FRAMES);
+
+    simulator.setPin(0, "123456");
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+
+    steady = runLoop(poller, link, port, simulator, 200, false);
+
+    CHECK(poller.reads[POLL_REAL_TIME_STATUS] > 0);
+    CHECK(poller.reads[POLL_STATUS] > 0);
+    CHECK(poller.reads[POLL_PINS] > 0);
+    CHECK(poller.queue.getDepthMax() > 1);
+
+    // Positive control: the same loop with a heap copy of each reply must be counted
+    control = runLoop(poller, link, port, simulator, 200, true);
+
+    printf("Steady-state poll loop: %u heap allocations in 200 exchanges (control with reply copies: %u)\n",
+           static_cast<unsigned>(steady), static_cast<unsigned>(control));
+    CHECK(steady == 0);
+    CHECK(control >= 200);
+
+    return (testFailures);
+}
@@ -0,0 +1,112 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Capture test
+ * Exchanges with the simulator are recorded by the link, stored in the
+ * capture ring, dumped as text log lines and loaded back: the replay must
+ * give the live results and decoded state.
+ */
+
+#include "kyo-simulator.h"
+#include "test.h"
+
+using namespace kyo_protocol;
+using kyo_host::Fault;
+
+int main() {
+    kyo_host::PanelSimulator simulator;
+    kyo_host::TtyTransport port;
+    CaptureBuffer<1024> capture;
+    CaptureRecord recording;
+    CaptureRecord record;
+    Result results[4];
+    char text[CAPTURE_TEXT_SIZE];
+    char line[CAPTURE_TEXT_SIZE + 64];
+    Command read = {FRAME_READ, REGION_MAP[REGION_STATUS].addr, static_cast<uint8_t>(REGION_MAP[REGION_STATUS].size - 1), 200};
+
+    simulator.setOutputs(0x05);
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+
+    // Nothing is recorded until a record is set
+    CHECK(runExchange(link, port, read) == RESULT_OK);
+    CHECK(link.getRecord() == nullptr);
+
+    link.setRecording(&recording);
+    simulator.injectFault(Fault::NOISE);
+    simulator.injectFault(Fault::BAD_CHECKSUM);
+    simulator.injectFault(Fault::SHORT_REPLY);
+
+    for (int i = 0; i < 4; i++) {
+        results[i] = runExchange(link, port, read);
+        CHECK(link.getRecord() == &recording);
+        capture.push(recording);
+    }
+
+    CHECK(results[0] == RESULT_OK);
+    CHECK(results[1] == RESULT_BAD_CHECKSUM);
+    CHECK(results[2] == RESULT_SHORT_REPLY);
+    CHECK(capture.getCount() == 4);
+
+    for (size_t i = 0; capture.read(i, record) == true; i++) {
+        FrameParser parser;
+        PanelMemory memory;
+        Status status;
+
+        // Log line as printed by dump_capture, loaded back as kyo-replay does
+        formatCapture(record, text);
+        snprintf(line, sizeof(line), "[12:00:00][I][esp-key-alarm:627]: capture %s", text);
+        CHECK(parseCapture(strstr(line, "capture ") + strlen("capture "), record));
+
+        CHECK(record.result == results[i]);
+        CHECK(record.requestSize == HEADER_SIZE);
+        CHECK(record.lastByte >= record.firstByte);
+        CHECK(replay(record, parser, memory) == results[i]);
+
+        if (results[i] == RESULT_OK) {
+            CHECK(decodeStatus(memory.getData(REGION_STATUS), memory.getSize(REGION_STATUS), status));
+            CHECK(status.outputs == 0x05);
+            CHECK(status.disarmed == 0xff);
+        } else {
+            CHECK(memory.isDirty(REGION_STATUS) == false);
+        }
+    }
+
+    // Truncated and corrupted text is rejected
+    formatCapture(record, text);
+    text[10] = '\0';
+    CHECK(parseCapture(text, record) == false);
+    CHECK(parseCapture("!!!!", record) == false);
+
+    // Oldest records are dropped to make room
+    CaptureBuffer<MAX_CAPTURE_RECORD_SIZE> small;
+    size_t size = CAPTURE_HEADER_SIZE + recording.requestSize + recording.receivedSize;
+
+    for (int i = 0; i < 10; i++) {
+        small.push(recording);
+    }
+
+    CHECK(small.getCount() == MAX_CAPTURE_RECORD_SIZE / size);
+    CHECK(small.getDropped() == 10 - small.getCount());
+    CHECK(small.read(small.getCount() - 1, record) && (record.receivedSize == recording.receivedSize));
+
+    return (testFailures);
+}
@@ -0,0 +1,117 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Clock test
+ * Panel clock encoding and decoding, drift of a clock read reply and the
+ * threshold deciding whether the clock is written.
+ */
+
+#include "test.h"
+
+using namespace kyo_protocol;
+
+// Times about an hour apart over 2000 - 2099 and a few odd dates survive encode and decode
+static void testRoundTrip() {
+    static const uint8_t dates[][CLOCK_SIZE] = {
+        {1, 1, 0, 0, 0, 0}, {29, 2, 0, 12, 30, 15}, {1, 3, 0, 0, 0, 0}, {31, 12, 0, 23, 59, 59},
+        {28, 2, 23, 6, 7, 8}, {29, 2, 24, 23, 59, 59}, {1, 3, 24, 0, 0, 0}, {31, 12, 99, 23, 59, 59},
+    };
+    uint8_t data[CLOCK_SIZE];
+    uint32_t seconds;
+    uint32_t decoded;
+    bool valid = true;
+
+    for (size_t i = 0; i < sizeof(dates) / sizeof(dates[0]); i++) {
+        CHECK(decodeClock(dates[i], CLOCK_SIZE, seconds) == true);
+        encodeClock(seconds, data);
+        CHECK(memcmp(data, dates[i], CLOCK_SIZE) == 0);
+    }
+
+    for (seconds = 0; seconds < getClockDays(100, 1, 1) * 86400; seconds += 3599) {
+        encodeClock(seconds, data);
+        valid &= (decodeClock(data, CLOCK_SIZE, decoded) == true) && (decoded == seconds);
+    }
+
+    CHECK(valid == true);
+
+    // 2024-02-29 23:59:59
+    CHECK(decodeClock(dates[5], CLOCK_SIZE, seconds) == true);
+    CHECK(seconds == (getClockDays(24, 2, 29) * 86400 + 23 * 3600 + 59 * 60 + 59));
+}
+
+static void testInvalid() {
+    static const uint8_t invalid[][CLOCK_SIZE] = {
+        {0, 1, 0, 0, 0, 0}, {32, 1, 0, 0, 0, 0}, {1, 0, 0, 0, 0, 0}, {1, 13, 0, 0, 0, 0},
+        {1, 1, 0, 24, 0, 0}, {1, 1, 0, 0, 60, 0}, {1, 1, 0, 0, 0, 60},
+    };
+    uint32_t seconds;
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        CHECK(decodeClock(invalid[i], CLOCK_SIZE, seconds) == false);
+    }
+
+    CHECK(decodeClock(invalid[0], CLOCK_SIZE - 1, seconds) == false);
+}
+
+// Reply is the clock followed by its checksum, drift is panel clock minus reference
+static void testDrift() {
+    uint8_t reply[CLOCK_SIZE + 1];
+    uint32_t reference = getClockDays(24, 6, 15) * 86400 + 12 * 3600;
+    int32_t drift = 0;
+
+    encodeClock(reference + 45, reply);
+    reply[CLOCK_SIZE] = getChecksum(reply, CLOCK_SIZE);
+
+    CHECK(getClockDrift(reply, sizeof(reply), reference, drift) == true);
+    CHECK(drift == 45);
+    CHECK(getClockDrift(reply, sizeof(reply), reference + 100, drift) == true);
+    CHECK(drift == -55);
+
+    // Short, empty and long replies are rejected before decoding
+    drift = 1234;
+    CHECK(getClockDrift(reply, 0, reference, drift) == false);
+    CHECK(getClockDrift(reply, 1, reference, drift) == false);
+    CHECK(getClockDrift(reply, CLOCK_SIZE, reference, drift) == false);
+    CHECK(getClockDrift(reply, CLOCK_SIZE + 2, reference, drift) == false);
+    CHECK(drift == 1234);
+
+    reply[1] = 13;
+    CHECK(getClockDrift(reply, sizeof(reply), reference, drift) == false);
+}
+
+// Clock is written only when off by more than the threshold, either way
+static void testThreshold() {
+    CHECK(isClockOff(0, 30) == false);
+    CHECK(isClockOff(30, 30) == false);
+    CHECK(isClockOff(-30, 30) == false);
+    CHECK(isClockOff(31, 30) == true);
+    CHECK(isClockOff(-31, 30) == true);
+    CHECK(isClockOff(1, 0) == true);
+    CHECK(isClockOff(INT32_MIN, 30) == true);
+    CHECK(isClockOff(INT32_MAX, UINT32_MAX) == false);
+}
+
+int main() {
+    testRoundTrip();
+    testInvalid();
+    testDrift();
+    testThreshold();
+
+    return (testFailures);
+}
@@ -0,0 +1,138 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Gateway test
+ * One gateway with a few worker threads drives many simulated panels at
+ * 9600 baud: all of them must be discovered and polled, a panel going
+ * offline must go down alone and be discovered again when it is back.
+ */
+
+#include <functional>
+
+#include "kyo-gateway.h"
+#include "kyo-simulator.h"
+#include "test.h"
+
+using namespace kyo_protocol;
+using kyo_host::PanelState;
+
+static const size_t PANELS = 32;
+static const AlarmModel MODELS[] = {AlarmModel::KYO_4, AlarmModel::KYO_8, AlarmModel::KYO_32};
+
+// Wait up to timeout ms for condition
+static bool waitFor(const std::function<bool()> &condition, uint32_t timeout) {
+    uint32_t start = kyo_host::getMillis();
+
+    while (condition() == false) {
+        if ((kyo_host::getMillis() - start) >= timeout) {
+            return (false);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    return (true);
+}
+
+int main() {
+    std::vector<std::unique_ptr<kyo_host::PanelSimulator>> simulators;
+    kyo_host::GatewayConfig config;
+
+    config.threads = 4;
+
+    kyo_host::Gateway gateway(config);
+
+    for (size_t i = 0; i < PANELS; i++) {
+        kyo_host::SimulatorConfig simulatorConfig;
+
+        simulatorConfig.model = MODELS[i % 3];
+        simulatorConfig.seed = i + 1;
+        simulators.push_back(std::unique_ptr<kyo_host::PanelSimulator>(new kyo_host::PanelSimulator(simulatorConfig)));
+        simulators[i]->setZones(i + 1);
+        CHECK(simulators[i]->start());
+        CHECK(gateway.add(simulators[i]->getPortName()));
+    }
+
+    CHECK(gateway.start());
+
+    // Every panel discovered with its own model and zones
+    CHECK(waitFor([&]() {
+        for (size_t i = 0; i < PANELS; i++) {
+            PanelState state = gateway.getPanel(i).getState();
+
+            if ((state.model != MODELS[i % 3]) || (state.realTime.zones != i + 1) || (state.status.disarmed == 0)) {
+                return (false);
+            }
+        }
+        return (true);
+    }, 5000));
+
+    // Changes are seen on the right panel only
+    simulators[5]->setZones(0x80);
+    CHECK(waitFor([&]() { return (gateway.getPanel(5).getState().realTime.zones == 0x80); }, 2000));
+    CHECK(gateway.getPanel(6).getState().realTime.zones == 7);
+
+    // A panel offline goes down alone (after three 1 s read timeouts), then it is discovered again
+    simulators[7]->setOnline(false);
+    CHECK(waitFor([&]() { return (gateway.getPanel(7).getState().health == LinkHealth::DOWN); }, 6000));
+    CHECK(gateway.getPanel(8).getState().health == LinkHealth::HEALTHY);
+
+    simulators[7]->setZones(0x40);
+    simulators[7]->setOnline(true);
+    CHECK(waitFor([&]() {
+        PanelState state = gateway.getPanel(7).getState();
+        return ((state.health == LinkHealth::HEALTHY) && (state.model == MODELS[7 % 3]) && (state.realTime.zones == 0x40));
+    }, 5000));
+    CHECK(gateway.getPanel(7).getState().rediscoveries == 1);
+
+    // Polling throughput and latency over one second
+    uint32_t reads = 0;
+    uint32_t completed = 0;
+    uint32_t latencySum = 0;
+    uint32_t latencyMax = 0;
+    uint64_t wakeups = gateway.getWakeups();
+
+    for (size_t i = 0; i < PANELS; i++) {
+        reads -= gateway.getPanel(i).getState().reads;
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    for (size_t i = 0; i < PANELS; i++) {
+        PanelState state = gateway.getPanel(i).getState();
+
+        reads += state.reads;
+        completed += state.completed;
+        latencySum += state.latencySum;
+        latencyMax = std::max(latencyMax, state.latencyMax);
+        CHECK(state.health == LinkHealth::HEALTHY);
+    }
+
+    wakeups = gateway.getWakeups() - wakeups;
+    gateway.stop();
+
+    printf("%u panels, %u threads: %u reads/s, latency %.1f ms average, %u ms max, %u wake-ups/s\n", static_cast<unsigned>(PANELS),
+           static_cast<unsigned>(config.threads), static_cast<unsigned>(reads), static_cast<double>(latencySum) / completed,
+           static_cast<unsigned>(latencyMax), static_cast<unsigned>(wakeups));
+
+    // Real-time status of each panel every 250 ms, status every second
+    CHECK(reads >= PANELS * 4);
+
+    return (testFailures);
+}
@@ -0,0 +1,155 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Event journal test
+ * Records are appended past the journal capacity with time deltas of one
+ * to several varint bytes, then read back with fresh and stale cursors
+ * and compared with a plain copy of everything appended.
+ */
+
+#include <vector>
+
+#include "test.h"
+
+using namespace kyo_protocol;
+
+typedef EventJournal<64> Journal;
+
+static bool isSame(const Event &a, const Event &b) {
+    return ((a.seq == b.seq) && (a.time == b.time) && (a.type == b.type) && (a.index == b.index) && (a.value == b.value));
+}
+
+// Append an event to the journal and to the reference copy
+static void append(Journal &journal, std::vector<Event> &appended, uint32_t time, EventType type, uint8_t index, bool value) {
+    Event event = {static_cast<uint32_t>(appended.size()), time, type, index, value};
+
+    journal.append(time, type, index, value);
+    appended.push_back(event);
+}
+
+// Deltas of 0 to 1 hour (1 to 3 varint bytes), times are whole ticks so they come back exact
+static uint32_t getDelta(size_t i) {
+    static const uint32_t deltas[] = {100, 1200, 12700, 12800, 0, 300000, 3600000, 500};
+
+    return (deltas[i % (sizeof(deltas) / sizeof(deltas[0]))]);
+}
+
+// Every record is read back in order, then the cursor is at the end
+static void testRoundTrip() {
+    Journal journal;
+    std::vector<Event> appended;
+    Journal::Cursor cursor = journal.begin();
+    Event event;
+    uint32_t time = 5000;
+
+    CHECK(journal.next(cursor, event) == false);
+
+    for (size_t i = 0; i < 8; i++) {
+        time += getDelta(i);
+        append(journal, appended, time, static_cast<EventType>(i % 4), static_cast<uint8_t>(i * 3), (i & 1) != 0);
+    }
+
+    CHECK(journal.getCount() == appended.size());
+    CHECK(journal.getUnread(cursor) == appended.size());
+
+    for (size_t i = 0; i < appended.size(); i++) {
+        CHECK(journal.next(cursor, event) == true);
+        CHECK(isSame(event, appended[i]) == true);
+    }
+
+    CHECK(journal.next(cursor, event) == false);
+    CHECK(journal.getUnread(cursor) == 0);
+
+    // Cursor at the end picks up records appended later
+    append(journal, appended, time + 700, EVENT_ZONE, 31, true);
+    CHECK(journal.getUnread(cursor) == 1);
+    CHECK(journal.next(cursor, event) == true);
+    CHECK(isSame(event, appended.back()) == true);
+}
+
+// Past capacity the oldest records are dropped, survivors keep their sequence numbers and absolute times
+static void testWrap() {
+    Journal journal;
+    std::vector<Event> appended;
+    Journal::Cursor stale = journal.begin();
+    Journal::Cursor current = journal.begin();
+    Event event;
+    uint32_t time = 0;
+    size_t first;
+
+    // Reader keeps up with the first records only
+    for (size_t i = 0; i < 4; i++) {
+        time += getDelta(i);
+        append(journal, appended, time, EVENT_ZONE, static_cast<uint8_t>(i), true);
+        CHECK(journal.next(current, event) == true);
+        CHECK(isSame(event, appended[i]) == true);
+    }
+
+    CHECK(journal.next(stale, event) == true);
+    CHECK(event.seq == 0);
+
+    for (size_t i = 4; i < 200; i++) {
+        time += getDelta(i);
+        append(journal, appended, time, static_cast<EventType>(i % 4), static_cast<uint8_t>(i % 32), (i % 3) == 0);
+    }
+
+    CHECK(journal.getCount() < appended.size());
+    CHECK(journal.getEnd() == appended.size());
+
+    // Survivors are the newest records, in order, from a fresh cursor
+    first = appended.size() - journal.getCount();
+    Journal::Cursor fresh = journal.begin();
+
+    for (size_t i = first; i < appended.size(); i++) {
+        CHECK(journal.next(fresh, event) == true);
+        CHECK(isSame(event, appended[i]) == true);
+    }
+
+    CHECK(journal.next(fresh, event) == false);
+
+    // A cursor on dropped records restarts from the oldest, the gap shows in the sequence number
+    CHECK(journal.getUnread(stale) == journal.getCount());
+    CHECK(journal.next(stale, event) == true);
+    CHECK(event.seq == first);
+    CHECK(event.seq > 1);
+    CHECK(isSame(event, appended[first]) == true);
+
+    CHECK(journal.next(current, event) == true);
+    CHECK(event.seq == first);
+    CHECK(event.time == appended[first].time);
+
+    // Keeps working across further wraps, with a reader following every append
+    for (size_t i = 200; i < 1000; i++) {
+        time += getDelta(i);
+        append(journal, appended, time, EVENT_TAMPER, static_cast<uint8_t>(i % 32), (i & 1) != 0);
+
+        while (journal.next(current, event) == true) {
+            CHECK(isSame(event, appended[event.seq]) == true);
+        }
+
+        CHECK(event.seq == i);
+    }
+}
+
+int main() {
+    testRoundTrip();
+    testWrap();
+
+    return (testFailures);
+}
@@ -0,0 +1,187 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Link test
+ * Link, frame parser and region decoders against simulated KYO4, KYO8
+ * and KYO32 panels on a pty, at 9600 baud with reply jitter and injected
+ * faults. Poll latency of the status read is reported on stdout.
+ */
+
+#include "kyo-simulator.h"
+#include "test.h"
+
+using namespace kyo_protocol;
+using kyo_host::Fault;
+
+static void testDiscovery(AlarmModel model) {
+    kyo_host::SimulatorConfig config;
+    config.model = model;
+
+    kyo_host::PanelSimulator simulator(config);
+    kyo_host::TtyTransport port;
+    PanelMemory memory;
+    AlarmInfo info;
+    uint8_t partsList = 0;
+
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+
+    CHECK(readRegions(link, port, memory, getRegionMask(REGION_ALARM_INFO) | getRegionMask(REGION_PARTITIONS)));
+    CHECK(decodeAlarmInfo(memory.getData(REGION_ALARM_INFO), memory.getSize(REGION_ALARM_INFO), info));
+    CHECK(info.alarmModel == model);
+    CHECK(strcmp(info.firmware, "2.13") == 0);
+    CHECK(decodePartitionsList(memory.getData(REGION_PARTITIONS), memory.getSize(REGION_PARTITIONS), partsList));
+    CHECK(partsList == ((getModelZones(model) > 8) ? 0xff : 0x0f));
+}
+
+static void testStatus() {
+    kyo_host::SimulatorConfig config;
+    config.jitter = 5;
+
+    kyo_host::PanelSimulator simulator(config);
+    kyo_host::TtyTransport port;
+    PanelMemory memory;
+    RealTimeStatus realTime;
+    Status status;
+    PinTable<KYO_STORED_PINS> pins;
+    uint32_t pinCode = 0;
+
+    simulator.setPin(3, "4321");
+    simulator.setZones(0x80000005);
+    simulator.setTampers(0x00000100);
+    simulator.setTamperFlags(TAMPER_SYSTEM);
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+
+    CHECK(readRegions(link, port, memory, getRegionMask(REGION_REAL_TIME_STATUS) | getRegionMask(REGION_STATUS) | getRegionMask(REGION_PINS)));
+    CHECK(decodeRealTimeStatus(memory.getData(REGION_REAL_TIME_STATUS), memory.getSize(REGION_REAL_TIME_STATUS), realTime));
+    CHECK(realTime.zones == 0x80000005);
+    CHECK(realTime.tampers == 0x00000100);
+    CHECK(realTime.tamperFlags == TAMPER_SYSTEM);
+
+    pins.load(memory.getData(REGION_PINS), memory.getSize(REGION_PINS));
+    CHECK(pins.getSize() == 1);
+    CHECK(encodePin("4321", pinCode) && pins.contains(pinCode));
+
+    // Arm partitions 1 - 3 away and bypass zone 2, then read status back
+    uint8_t arm[getDataSize(CMD_CTRL_PARTITIONS)] = {0x07, 0x00, 0x00, 0x00};
+    uint8_t bypass[getDataSize(CMD_ZONE_BYPASS)] = {0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00};
+
+    CHECK(runExchange(link, port, CMD_CTRL_PARTITIONS, arm) == RESULT_OK);
+    CHECK(runExchange(link, port, CMD_CLOSE) == RESULT_OK);
+    CHECK(runExchange(link, port, CMD_ZONE_BYPASS, bypass) == RESULT_OK);
+    CHECK(readRegions(link, port, memory, getRegionMask(REGION_STATUS)));
+    CHECK(memory.isDirty(REGION_STATUS, ST_ARMED, 1));
+    CHECK(decodeStatus(memory.getData(REGION_STATUS), memory.getSize(REGION_STATUS), status));
+    CHECK(status.armedAway == 0x07);
+    CHECK(status.disarmed == 0xf8);
+    CHECK(status.bypassed == 0x00000002);
+}
+
+static void testFaults() {
+    kyo_host::PanelSimulator simulator;
+    kyo_host::TtyTransport port;
+    Command read = {FRAME_READ, REGION_MAP[REGION_STATUS].addr, static_cast<uint8_t>(REGION_MAP[REGION_STATUS].size - 1), 200};
+
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+
+    simulator.injectFault(Fault::BAD_CHECKSUM);
+    CHECK(runExchange(link, port, read) == RESULT_BAD_CHECKSUM);
+
+    simulator.injectFault(Fault::SHORT_REPLY);
+    CHECK(runExchange(link, port, read) == RESULT_SHORT_REPLY);
+
+    simulator.injectFault(Fault::NO_REPLY);
+    CHECK(runExchange(link, port, read) == RESULT_TIMEOUT);
+    CHECK(link.getWaitState() == TtyLink::State::WAIT_REPLY);
+
+    simulator.injectFault(Fault::NO_ECHO);
+    CHECK(runExchange(link, port, read) == RESULT_TIMEOUT);
+    CHECK(link.getWaitState() == TtyLink::State::WAIT_ECHO);
+
+    // Noise before the echo is skipped
+    simulator.injectFault(Fault::NOISE);
+    CHECK(runExchange(link, port, read) == RESULT_OK);
+    CHECK(link.getParser().getDiscarded() > 0);
+
+    CHECK(link.getStats().getCount(STAT_STATUS, RESULT_OK) == 1);
+    CHECK(link.getStats().getErrors() == 4);
+}
+
+// Status read round trip at 9600 baud, 26 bytes on the line
+static void testLatency() {
+    const int reads = 20;
+    kyo_host::SimulatorConfig config;
+    config.jitter = 4;
+
+    kyo_host::PanelSimulator simulator(config);
+    kyo_host::TtyTransport port;
+    PanelMemory memory;
+
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+
+    for (int i = 0; i < reads; i++) {
+        CHECK(readRegions(link, port, memory, getRegionMask(REGION_STATUS)));
+    }
+
+    uint32_t average = link.getStats().getLatencySum() / reads;
+
+    printf("Status poll latency: %u ms average, %u reads <= %u ms\n", static_cast<unsigned>(average),
+           static_cast<unsigned>(link.getStats().getLatencyBucket(1)), LATENCY_BOUNDS[1]);
+    CHECK(average < 50);
+}
+
+// Probes share the alarm info stat id but have no handler, they must not lower its average
+static void testHandlerStats() {
+    LinkStats stats;
+    HandlerStats handlers;
+
+    stats.record(getStatId(CMD_PROBE), RESULT_OK, 10);
+    stats.record(getStatId(CMD_PROBE), RESULT_TIMEOUT, 100);
+    stats.record(STAT_ALARM_INFO, RESULT_OK, 10);
+    handlers.record(STAT_ALARM_INFO, 30);
+
+    CHECK(getStatId(CMD_PROBE) == STAT_ALARM_INFO);
+    CHECK(stats.getCount(STAT_ALARM_INFO, RESULT_OK) == 2);
+    CHECK(handlers.getAverage(STAT_ALARM_INFO) == 30);
+    CHECK(handlers.getMax(STAT_ALARM_INFO) == 30);
+    CHECK(handlers.getAverage(STAT_STATUS) == 0);
+}
+
+int main() {
+    testDiscovery(AlarmModel::KYO_4);
+    testDiscovery(AlarmModel::KYO_8);
+    testDiscovery(AlarmModel::KYO_32);
+    testStatus();
+    testFaults();
+    testLatency();
+    testHandlerStats();
+
+    return (testFailures);
+}
@@ -0,0 +1,257 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Link worker test
+ * Stress tests the thread handoff of the core with std::thread: the seqlock
+ * snapshot must never hand out a torn copy (torn ones are detected and
+ * retried), the SPSC ring must keep order without losses, and a link run
+ * by a worker thread against the simulator must give the same exchanges as
+ * the link run in place, as on ESP32 where it runs on its own task.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "kyo-simulator.h"
+#include "test.h"
+
+using namespace kyo_protocol;
+using kyo_host::Fault;
+
+// Each snapshot repeats its sequence number in every word, a torn copy mixes two of them
+struct Sample {
+    uint32_t words[64];
+};
+
+static void testSeqlock() {
+    const uint32_t writes = 2000000;
+    SeqlockSnapshot<Sample> snapshot;
+    std::atomic<bool> done{false};
+    std::atomic<uint32_t> accepted{0};
+    std::atomic<uint32_t> rejected{0};
+    std::atomic<uint32_t> torn{0};
+    std::atomic<uint32_t> backwards{0};
+
+    auto reader = [&]() {
+        uint32_t last = 0;
+        Sample sample;
+
+        while (done == false) {
+            if (snapshot.tryRead(sample) == false) {
+                rejected++;
+                continue;
+            }
+
+            accepted++;
+
+            for (uint32_t word: sample.words) {
+                if (word != sample.words[0]) {
+                    torn++;
+                    break;
+                }
+            }
+
+            if (sample.words[0] < last) {
+                backwards++;
+            }
+
+            last = sample.words[0];
+        }
+    };
+
+    std::thread readers[2] = {std::thread(reader), std::thread(reader)};
+
+    for (uint32_t i = 1; i <= writes; i++) {
+        Sample sample;
+
+        std::fill(sample.words, sample.words + 64, i);
+        snapshot.write(sample);
+    }
+
+    done = true;
+
+    for (std::thread &thread: readers) {
+        thread.join();
+    }
+
+    Sample last;
+    snapshot.read(last);
+
+    printf("Seqlock: %u writes, %u reads, %u torn copies detected, %u accepted torn\n", static_cast<unsigned>(writes),
+           static_cast<unsigned>(accepted), static_cast<unsigned>(rejected), static_cast<unsigned>(torn));
+    CHECK(torn == 0);
+    CHECK(backwards == 0);
+    CHECK(accepted > 0);
+    CHECK(snapshot.getVersion() == writes);
+    CHECK(last.words[0] == writes);
+}
+
+static void testSpscRing() {
+    const uint32_t items = 2000000;
+    SpscRing<uint32_t, 16> ring;
+    uint32_t expected = 0;
+    uint32_t errors = 0;
+
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < items;) {
+            if (ring.push(i) == true) {
+                i++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    while (expected < items) {
+        uint32_t item;
+
+        if (ring.pop(item) == true) {
+            errors += (item != expected) ? 1 : 0;
+            expected++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    producer.join();
+
+    CHECK(errors == 0);
+    CHECK(ring.isEmpty());
+}
+
+static void testWorker() {
+    typedef LinkWorker<kyo_host::TtyTransport> TtyWorker;
+    kyo_host::PanelSimulator simulator;
+    kyo_host::TtyTransport port;
+    std::atomic<bool> running{true};
+    Command read = {FRAME_READ, REGION_MAP[REGION_REAL_TIME_STATUS].addr, static_cast<uint8_t>(REGION_MAP[REGION_REAL_TIME_STATUS].size - 1), 200};
+    Frame request;
+    LinkResult result;
+    RealTimeStatus status;
+    uint32_t mismatches = 0;
+
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+    TtyWorker worker(link);
+
+    std::thread thread([&]() {
+        while (running == true) {
+            worker.service(kyo_host::getMillis());
+            port.wait(1);
+        }
+    });
+
+    // Run a request on the worker, the client thread only polls for the result
+    auto exchange = [&]() {
+        CHECK(worker.submit(request, read));
+
+        while (worker.poll(result) == false) {
+            std::this_thread::yield();
+        }
+    };
+
+    encode(read, request);
+
+    for (uint32_t i = 1; i <= 100; i++) {
+        simulator.setZones(i);
+        exchange();
+
+        if ((result.timeout == true) || (result.parser.isValid() == false) ||
+            (decodeRealTimeStatus(result.parser.getReply(), result.parser.getReplySize() - 1, status) == false) || (status.zones != i)) {
+            mismatches++;
+        }
+    }
+
+    CHECK(mismatches == 0);
+    CHECK(result.job == 100);
+    CHECK(result.stats.getCount(STAT_REAL_TIME_STATUS, RESULT_OK) == 100);
+
+    simulator.injectFault(Fault::BAD_CHECKSUM);
+    exchange();
+    CHECK((result.timeout == false) && (result.parser.getResult() == RESULT_BAD_CHECKSUM));
+
+    simulator.injectFault(Fault::NO_ECHO);
+    exchange();
+    CHECK((result.timeout == true) && (result.echoTimeout == true));
+
+    simulator.injectFault(Fault::NO_REPLY);
+    exchange();
+    CHECK((result.timeout == true) && (result.echoTimeout == false));
+    CHECK(result.stats.getErrors() == 3);
+
+    running = false;
+    thread.join();
+}
+
+// A full jobs ring refuses a request, which is taken once the worker has started the previous one
+static void testWorkerFull() {
+    typedef LinkWorker<kyo_host::TtyTransport> TtyWorker;
+    kyo_host::PanelSimulator simulator;
+    kyo_host::TtyTransport port;
+    Command read = {FRAME_READ, REGION_MAP[REGION_REAL_TIME_STATUS].addr, static_cast<uint8_t>(REGION_MAP[REGION_REAL_TIME_STATUS].size - 1), 200};
+    Frame request;
+    LinkResult result;
+    uint32_t accepted = 0;
+
+    CHECK(simulator.start());
+    CHECK(port.open(simulator.getPortName().c_str()));
+
+    TtyLink link(port);
+    TtyWorker worker(link);
+
+    encode(read, request);
+
+    // Worker not serviced, the ring fills up
+    while ((accepted < 8) && (worker.submit(request, read) == true)) {
+        accepted++;
+    }
+
+    CHECK((accepted > 0) && (accepted < 8));
+    CHECK(worker.submit(request, read) == false);
+
+    // Held request is submitted again until taken, only the last submitted one completes the exchange
+    worker.service(kyo_host::getMillis());
+    CHECK(worker.submit(request, read) == true);
+    accepted++;
+
+    for (uint32_t start = kyo_host::getMillis(); (kyo_host::getMillis() - start) < 5000;) {
+        worker.service(kyo_host::getMillis());
+
+        if (worker.poll(result) == true) {
+            break;
+        }
+
+        port.wait(1);
+    }
+
+    CHECK(result.job == accepted);
+    CHECK((result.timeout == false) && (result.parser.isValid() == true));
+}
+
+int main() {
+    testSeqlock();
+    testSpscRing();
+    testWorker();
+    testWorkerFull();
+
+    return (testFailures);
+}
@@ -0,0 +1,72 @@
+/*
+* esp-kyo-alarm - ESPHome custom component for KYO alarm panels
+* Copyright (C) 2021 Luca Cavalli
+*
+* This program is free software: you can redistribute it and/or modify it under
+* the terms of the GNU General Public License as published by the Free Software
+* Foundation, either version 3 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+* PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with this
+* program. If not, see <https://www.gnu.org/licenses/>.
+*
+* SPDX-License-Identifier: GPL-3.0-or-later
+*/
+
+/*
+ * Host tests helpers
+ * Each test program runs its checks and returns the number of failed ones.
+ */
+
+#pragma once
+
+#include <cstdio>
+
+#include "kyo-protocol.h"
+#include "kyo-tty.h"
+
+static int testFailures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            testFailures++; \
+        } \
+    } while (0)
+
+typedef kyo_protocol::Link<kyo_host::TtyTransport> TtyLink;
+
+// Run a request to completion, returns the transaction result
+inline kyo_protocol::Result runExchange(TtyLink &link, kyo_host::TtyTransport &port, const kyo_protocol::Command &command,
+                                        const uint8_t *data = nullptr) {
+    kyo_protocol::Frame request;
+
+    kyo_protocol::encode(command, request, data);
+    link.start(request, command, kyo_host::getMillis());
+
+    while (link.process(kyo_host::getMillis()) == TtyLink::Event::NONE) {
+        port.wait(1);
+    }
+
+    return (link.getParser().getResult());
+}
+
+// Read regions into the memory mirror, returns true if all frames succeeded
+inline bool readRegions(TtyLink &link, kyo_host::TtyTransport &port, kyo_protocol::PanelMemory &memory, uint32_t regions) {
+    kyo_protocol::Command frames[4];
+    size_t count = kyo_protocol::planReads(regions, frames, 4);
+
+    for (size_t i = 0; i < count; i++) {
+        if (runExchange(link, port, frames[i]) != kyo_protocol::RESULT_OK) {
+            return (false);
+        }
+
+        memory.store(frames[i].addr, link.getParser().getReply(), link.getParser().getReplySize() - 1);
+    }
+
+    return (true);
+}